@@ -0,0 +1,105 @@
+/////////////////////////////////////////////////////////////////
+// DistanceMatrix.h
+//
+// Packed storage for the pairwise distances of the guide tree.
+/////////////////////////////////////////////////////////////////
+
+#ifndef DISTANCEMATRIX_H
+#define DISTANCEMATRIX_H
+
+#include <algorithm>
+#include <cassert>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include "SafeVector.h"
+
+using namespace std;
+
+// number of floats in a cache line
+const int DISTANCE_ROW_ALIGNMENT = 16;
+
+/////////////////////////////////////////////////////////////////
+// DistanceMatrix
+//
+// Symmetric matrix of which only the lower triangle, diagonal
+// included, is stored, in a single block.  Row i holds entries
+// (i,0) to (i,i) contiguously and starts on a cache line, so that
+// the distances of one cluster to all clusters of lower index are
+// read from consecutive memory.  Either order of the indices
+// refers to the same entry.
+/////////////////////////////////////////////////////////////////
+
+class DistanceMatrix {
+
+	int size;                                       // number of rows
+	SafeVector<size_t> rowOffsets;                  // offset of each row
+	float *data;                                    // entries of all rows
+
+	DistanceMatrix(const DistanceMatrix &);
+	DistanceMatrix &operator=(const DistanceMatrix &);
+
+public:
+
+	/////////////////////////////////////////////////////////////////
+	// DistanceMatrix::DistanceMatrix()
+	//
+	// Constructor.  Creates a size x size matrix of zeros.
+	/////////////////////////////////////////////////////////////////
+
+	DistanceMatrix(int size) :
+			size(size), rowOffsets(size), data(NULL) {
+		size_t numEntries = 0;
+		for (int i = 0; i < size; i++) {
+			rowOffsets[i] = numEntries;
+			numEntries += (i + DISTANCE_ROW_ALIGNMENT) / DISTANCE_ROW_ALIGNMENT
+					* DISTANCE_ROW_ALIGNMENT;
+		}
+		if (numEntries == 0)
+			return;
+		void *block;
+		if (posix_memalign(&block, DISTANCE_ROW_ALIGNMENT * sizeof(float),
+				numEntries * sizeof(float)) != 0) {
+			cerr << "ERROR: Distance matrix memory allocation failed" << endl;
+			exit(1);
+		}
+		data = (float *) block;
+		memset(data, 0, numEntries * sizeof(float));
+	}
+
+	~DistanceMatrix() {
+		free(data);
+	}
+
+	/////////////////////////////////////////////////////////////////
+	// DistanceMatrix::GetSize()
+	//
+	// Returns the number of rows (and columns) of the matrix.
+	/////////////////////////////////////////////////////////////////
+
+	int GetSize() const {
+		return size;
+	}
+
+	/////////////////////////////////////////////////////////////////
+	// DistanceMatrix::operator()
+	//
+	// Returns the entry (i,j), which is also entry (j,i).
+	/////////////////////////////////////////////////////////////////
+
+	float &operator()(int i, int j) {
+		if (i < j)
+			swap(i, j);
+		assert(0 <= j && i < size);
+		return data[rowOffsets[i] + j];
+	}
+
+	float operator()(int i, int j) const {
+		if (i < j)
+			swap(i, j);
+		assert(0 <= j && i < size);
+		return data[rowOffsets[i] + j];
+	}
+};
+
+#endif
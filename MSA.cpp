@@ -27,12 +27,19 @@
 
 #include "MSA.h"
 #include "MSAClusterTree.h"
+#include "MSANJTree.h"
+#include "MSAEmbedTree.h"
+#include "MSANewickTree.h"
 #include "Defaults.h"
 
 #ifdef _OPENMP
 #include <omp.h>
 #endif
 
+#ifdef GLPROBS_MPI
+#include <mpi.h>
+#endif
+
 string parametersInputFilename = "";
 string parametersOutputFilename = "no training";
 string annotationFilename = "";
@@ -44,6 +51,23 @@ bool enableAlignOrder = false;
 int numConsistencyReps = 2;
 int numPreTrainingReps = 0;
 int numIterativeRefinementReps = 100;
+int posteriorBits = 32;
+string spillDirectory = "";
+int spillMemory = 256;
+int rowCellCap = 0;
+float rowMassCap = 1;
+int pairCellCap = 0;
+string guideTreeMethod = "upgma";
+string guideTreeInFile = "";
+string guideTreeOutFile = "";
+float rebalanceTolerance = -1;	// negative: keep the guide tree as built
+bool enableAggregatePosteriors = false;
+int samplePairBudget = 0;	// 0: profile posteriors from all sequence pairs
+float anchorFraction = 0;	// 0: profile alignments without anchors
+
+// MPI rank of this process and number of ranks
+int mpiRank = 0;
+int mpiSize = 1;
 
 float cutoff = 0;
 
@@ -65,6 +89,10 @@ const int MAX_CONSISTENCY_REPS = 5;
 const int MIN_ITERATIVE_REFINEMENT_REPS = 0;
 const int MAX_ITERATIVE_REFINEMENT_REPS = 1000;
 
+// subtrees holding at most 1/(TASKS_PER_THREAD * threads) of the
+// sequences are aligned as independent tasks
+const int TASKS_PER_THREAD = 4;
+
 string posteriorProbsFilename = "";
 bool allscores = true;
 string infilename;
@@ -131,6 +159,16 @@ double GetElapsedTime ( unsigned long int startTime )
 
 MSA::MSA(int argc, char* argv[]) {
 
+#ifdef GLPROBS_MPI
+	MPI_Comm_rank(MPI_COMM_WORLD, &mpiRank);
+	MPI_Comm_size(MPI_COMM_WORLD, &mpiSize);
+
+	// every rank computes the same alignment, but only the first
+	// reports progress
+	if (mpiRank > 0)
+		cerr.rdbuf(NULL);
+#endif
+
 	PrintHeading();
 
 	//parse program parameters
@@ -175,11 +213,14 @@ MSA::MSA(int argc, char* argv[]) {
 	MultiSequence *alignment = doAlign(sequences,
 			ProbabilisticModel(initDistrib, gapOpen, gapExtend, emitPairs,emitSingle), levelid);
 
-	//write the alignment results to standard output
-	if (enableClustalWOutput) {
-		alignment->WriteALN(*alignOutFile);
-	} else {
-		alignment->WriteMFA(*alignOutFile);
+	//write the alignment results to standard output, from the first
+	//MPI rank only
+	if (mpiRank == 0) {
+		if (enableClustalWOutput) {
+			alignment->WriteALN(*alignOutFile);
+		} else {
+			alignment->WriteMFA(*alignOutFile);
+		}
 	}
 
 	//release resources
@@ -272,11 +313,14 @@ MultiSequence* MSA::doAlign(MultiSequence *sequences,
 	startTime = GetTime();
 	//get the number of sequences
 	const int numSeqs = sequences->GetNumSequences();
-	//create distance matrix
-	VVF distances(numSeqs, VF(numSeqs, 0));
-        //creat sparseMatrices
-        SafeVector<SafeVector<SparseMatrix *> > sparseMatrices(numSeqs,
-			SafeVector<SparseMatrix *>(numSeqs, NULL)); 
+	//create distance matrix, unless the guide tree is read from a file
+	const bool computeDistances = guideTreeInFile.length() == 0;
+	DistanceMatrix distances(computeDistances ? numSeqs : 0);
+	//create the arenas of sparse matrices
+	PairMatrixStore sparseMatrices(sequences, posteriorBits, spillDirectory,
+			(size_t) spillMemory << 20);
+	SparsityCap sparsityCap(rowCellCap, rowMassCap, pairCellCap);
+	double totalMass = 0, droppedMass = 0;
 
 #ifdef _OPENMP
 	//calculate sequence pairs for openmp model
@@ -293,7 +337,7 @@ MultiSequence* MSA::doAlign(MultiSequence *sequences,
 #endif
 	// do all pairwise alignments for posterior probability matrices
 #ifdef _OPENMP
-#pragma omp parallel for private(pairIdx) default(shared) schedule(dynamic)
+#pragma omp parallel for private(pairIdx) default(shared) schedule(dynamic) reduction(+:totalMass, droppedMass)
 	for(pairIdx = 0; pairIdx < numPairs; pairIdx++) {
 		int a= seqsPairs[pairIdx].seq1;
 		int b = seqsPairs[pairIdx].seq2;
@@ -378,33 +422,66 @@ MultiSequence* MSA::doAlign(MultiSequence *sequences,
 			}
 
             assert(posterior);
-			// perform the pairwise sequence alignment
-			pair<SafeVector<char> *, float> alignment = model.ComputeAlignment(
-			seq1->GetLength(), seq2->GetLength(), *posterior);
-
-			//compute expected accuracy
-			distances[a][b] = distances[b][a] = 1.0f - alignment.second
-					/ min(seq1->GetLength(), seq2->GetLength());
+			if (computeDistances) {
+				// perform the pairwise sequence alignment
+				pair<SafeVector<char> *, float> alignment =
+						model.ComputeAlignment(seq1->GetLength(),
+								seq2->GetLength(), *posterior);
+
+				//compute expected accuracy
+				distances(a, b) = 1.0f - alignment.second
+						/ min(seq1->GetLength(), seq2->GetLength());
+				delete alignment.first;
+			}
 
 			// compute sparse representations
-			sparseMatrices[a][b] = new SparseMatrix(seq1->GetLength(),
-			seq2->GetLength(), *posterior);
-			sparseMatrices[b][a] = NULL;
+			if (sparsityCap.IsActive())
+				sparsityCap.Apply(seq1->GetLength(), seq2->GetLength(),
+						*posterior, totalMass, droppedMass);
+			sparseMatrices.Stage(a, b, *posterior);
 
 			delete posterior;
-			delete alignment.first;
 #ifndef _OPENMP
 		}
 #endif
 	} 
+	sparseMatrices.Pack();
+	if (enableVerbose)
+		cerr << "Posterior matrices use "
+				<< sparseMatrices.GetMemoryUsage() / 1024 << " KB with "
+				<< posteriorBits << "-bit values"
+				<< (spillDirectory != "" ? ", spilled to disk" : "") << endl;
+	if (sparsityCap.IsActive())
+		cerr << "[Main] Sparsity caps dropped " << fixed << setprecision(4)
+				<< (totalMass > 0 ? 100 * droppedMass / totalMass : 0)
+				<< "% of the posterior mass." << endl;
 	
 	timeUsed = GetElapsedTime ( startTime );	
  	cerr << "[Main] HMM computation used " << fixed << setprecision(4) << timeUsed << " seconds." << endl;
 	double lastUsed = timeUsed;
 
 	//create the guide tree
-	this->tree = new MSAClusterTree(this, distances, numSeqs);
+	if (!computeDistances)
+		this->tree = new MSANewickTree(this, distances, numSeqs, sequences,
+				guideTreeInFile);
+	else if (guideTreeMethod == "nj")
+		this->tree = new MSANJTree(this, distances, numSeqs);
+	else if (guideTreeMethod == "mbed")
+		this->tree = new MSAEmbedTree(this, distances, numSeqs);
+	else
+		this->tree = new MSAClusterTree(this, distances, numSeqs);
 	this->tree->create();
+	if (rebalanceTolerance >= 0)
+		this->tree->rebalance(rebalanceTolerance);
+	if (guideTreeOutFile.length() > 0 && mpiRank == 0) {
+		ofstream treeOutFile(guideTreeOutFile.c_str());
+		if (!treeOutFile) {
+			cerr << "ERROR: Could not write guide tree file "
+					<< guideTreeOutFile << endl;
+			exit(1);
+		}
+		this->tree->writeNewick(treeOutFile, sequences);
+	}
 
 	timeUsed = GetElapsedTime ( startTime );
  	cerr << "[Main] Guide Tree construction used " << timeUsed - lastUsed << " seconds." << endl;
@@ -417,17 +494,12 @@ MultiSequence* MSA::doAlign(MultiSequence *sequences,
 		fweights[r] *= 10;
 	}
 	for (int r = 0; r < numConsistencyReps; r++) {
-		SafeVector<SafeVector<SparseMatrix *> > newSparseMatrices =
-				DoRelaxation(fweights, sequences, sparseMatrices);
+		DoRelaxation(fweights, sequences, sparseMatrices);
 
 		// now replace the old posterior matrices
-		for (int i = 0; i < numSeqs; i++) {
-			for (int j = 0; j < numSeqs; j++) {
-				delete sparseMatrices[i][j];
-				sparseMatrices[i][j] = newSparseMatrices[i][j];
-			}
-		}
+		sparseMatrices.Swap();
 	}
+	sparseMatrices.ReleaseNext();
 	delete[] fweights;
 #ifdef _OPENMP
 	delete [] seqsPairs;
@@ -436,6 +508,7 @@ MultiSequence* MSA::doAlign(MultiSequence *sequences,
 	timeUsed = GetElapsedTime ( startTime );
  	cerr << "[Main] Consistence transformation used " << timeUsed - lastUsed << " seconds." << endl;
 
+
 	//compute the final multiple sequence alignment
 	MultiSequence *finalAlignment = ComputeFinalAlignment(this->tree, sequences,
 			sparseMatrices, model,levelid);
@@ -448,14 +521,6 @@ MultiSequence* MSA::doAlign(MultiSequence *sequences,
 	delete this->tree;
 	this->tree = 0;
 
-	// delete sparse matrices
-	for (int a = 0; a < numSeqs - 1; a++) {
-		for (int b = a + 1; b < numSeqs; b++) {
-			delete sparseMatrices[a][b];
-			delete sparseMatrices[b][a];
-		}
-	}
-
 	return finalAlignment;
 }
 
@@ -710,7 +775,51 @@ void MSA::printUsage() {
 			<< "              use " << MIN_ITERATIVE_REFINEMENT_REPS
 			<< " <= REPS <= " << MAX_ITERATIVE_REFINEMENT_REPS << " (default: "
 			<< numIterativeRefinementReps << ") passes of iterative-refinement"
-			<< endl << endl << "       -v, --verbose" << endl
+			<< endl << endl << "       -gt, --guide-tree METHOD" << endl
+			<< "              build the guide tree by METHOD = upgma, nj (neighbor-joining) or"
+			<< endl
+			<< "              mbed (sequence embedding, for very large families) (default: "
+			<< guideTreeMethod << ")" << endl << endl
+			<< "       -gti, --guide-tree-in FILENAME" << endl
+			<< "              read the guide tree from a Newick file instead of building it"
+			<< endl << endl << "       -gto, --guide-tree-out FILENAME" << endl
+			<< "              write the guide tree to a Newick file" << endl
+			<< endl << "       -rb, --rebalance-tree TOLERANCE" << endl
+			<< "              re-root the guide tree at its centroid and balance the chains of"
+			<< endl
+			<< "              branches shorter than 0 <= TOLERANCE <= 1 times its height (default: off)"
+			<< endl << endl << "       -ag, --aggregate-posteriors" << endl
+			<< "              build profile posteriors from sums of pair posteriors kept for"
+			<< endl
+			<< "              every subtree of the guide tree (default: "
+			<< (enableAggregatePosteriors ? "on" : "off") << ")" << endl
+			<< endl << "       -sp, --sample-pairs PAIRS" << endl
+			<< "              estimate the posterior of two profiles with more than PAIRS > 0"
+			<< endl
+			<< "              sequence pairs from PAIRS pairs sampled by weight (default: all pairs)"
+			<< endl << endl << "       -an, --anchor-fraction FRACTION" << endl
+			<< "              fix the column pairs of two profiles whose posterior exceeds"
+			<< endl
+			<< "              0 < FRACTION <= 1 times its maximum, and align only between them (default: off)"
+			<< endl
+			<< endl << "       -pb, --posterior-bits BITS" << endl
+			<< "              store posterior probabilities with BITS = 8, 16 or 32 (default: "
+			<< posteriorBits << ") bits each" << endl << endl
+			<< "       -spill, --spill-dir DIRECTORY" << endl
+			<< "              keep posterior matrices in a memory-mapped file in DIRECTORY"
+			<< endl << endl << "       -sm, --spill-memory MB" << endl
+			<< "              keep about MB (default: " << spillMemory
+			<< ") megabytes of spilled matrices in memory" << endl << endl
+			<< "       -rc, --row-cells CELLS" << endl
+			<< "              keep at most CELLS > 0 cells per posterior matrix row (default: no limit)"
+			<< endl << endl << "       -rm, --row-mass FRACTION" << endl
+			<< "              keep the most probable cells of each posterior matrix row up to"
+			<< endl
+			<< "              0 < FRACTION <= 1 of its mass (default: " << rowMassCap
+			<< ")" << endl << endl << "       -pc, --pair-cells CELLS" << endl
+			<< "              keep at most CELLS > 0 cells per posterior matrix (default: no limit)"
+			<< endl << endl
+			<< "       -v, --verbose" << endl
 			<< "              report progress while aligning (default: "
 			<< (enableVerbose ? "on" : "off") << ")" << endl << endl
 			<< "       -annot FILENAME" << endl
@@ -829,6 +938,250 @@ SafeVector<string> MSA::ParseParams(int argc, char **argv) {
 				}
 			}
 
+			// guide tree construction method
+			else if (!strcmp(argv[i], "-gt")
+					|| !strcmp(argv[i], "--guide-tree")) {
+				if (i < argc - 1) {
+					guideTreeMethod = argv[++i];
+					if (guideTreeMethod != "upgma" && guideTreeMethod != "nj"
+							&& guideTreeMethod != "mbed") {
+						cerr << "ERROR: For option " << argv[i - 1]
+								<< ", method must be upgma, nj or mbed." << endl;
+						exit(1);
+					}
+				} else {
+					cerr << "ERROR: Method expected for option " << argv[i]
+							<< endl;
+					exit(1);
+				}
+			}
+
+			// guide tree files
+			else if (!strcmp(argv[i], "-gti")
+					|| !strcmp(argv[i], "--guide-tree-in")) {
+				if (i < argc - 1) {
+					guideTreeInFile = argv[++i];
+				} else {
+					cerr << "ERROR: Filename expected for option " << argv[i]
+							<< endl;
+					exit(1);
+				}
+			} else if (!strcmp(argv[i], "-gto")
+					|| !strcmp(argv[i], "--guide-tree-out")) {
+				if (i < argc - 1) {
+					guideTreeOutFile = argv[++i];
+				} else {
+					cerr << "ERROR: Filename expected for option " << argv[i]
+							<< endl;
+					exit(1);
+				}
+			}
+
+			// guide tree rebalancing
+			else if (!strcmp(argv[i], "-rb")
+					|| !strcmp(argv[i], "--rebalance-tree")) {
+				if (i < argc - 1) {
+					if (!GetFloat(argv[++i], &tempFloat)) {
+						cerr << "ERROR: Invalid floating-point value following option "
+								<< argv[i - 1] << ": " << argv[i] << endl;
+						exit(1);
+					} else {
+						if (tempFloat < 0 || tempFloat > 1) {
+							cerr << "ERROR: For option " << argv[i - 1]
+									<< ", floating-point value must be between 0 and 1."
+									<< endl;
+							exit(1);
+						} else
+							rebalanceTolerance = tempFloat;
+					}
+				} else {
+					cerr << "ERROR: Floating-point value expected for option "
+							<< argv[i] << endl;
+					exit(1);
+				}
+			}
+
+			// profile posteriors from subtree aggregates
+			else if (!strcmp(argv[i], "-ag")
+					|| !strcmp(argv[i], "--aggregate-posteriors")) {
+				enableAggregatePosteriors = true;
+			}
+
+			// profile posteriors from sampled sequence pairs
+			else if (!strcmp(argv[i], "-sp")
+					|| !strcmp(argv[i], "--sample-pairs")) {
+				if (i < argc - 1) {
+					if (!GetInteger(argv[++i], &tempInt)) {
+						cerr << "ERROR: Invalid integer following option "
+								<< argv[i - 1] << ": " << argv[i] << endl;
+						exit(1);
+					} else {
+						if (tempInt <= 0) {
+							cerr << "ERROR: For option " << argv[i - 1]
+									<< ", integer must be positive." << endl;
+							exit(1);
+						} else
+							samplePairBudget = tempInt;
+					}
+				} else {
+					cerr << "ERROR: Integer expected for option " << argv[i]
+							<< endl;
+					exit(1);
+				}
+			}
+
+			// anchored profile alignment
+			else if (!strcmp(argv[i], "-an")
+					|| !strcmp(argv[i], "--anchor-fraction")) {
+				if (i < argc - 1) {
+					if (!GetFloat(argv[++i], &tempFloat)) {
+						cerr << "ERROR: Invalid floating-point value following option "
+								<< argv[i - 1] << ": " << argv[i] << endl;
+						exit(1);
+					} else {
+						if (tempFloat <= 0 || tempFloat > 1) {
+							cerr << "ERROR: For option " << argv[i - 1]
+									<< ", floating-point value must be greater than 0 and at most 1."
+									<< endl;
+							exit(1);
+						} else
+							anchorFraction = tempFloat;
+					}
+				} else {
+					cerr << "ERROR: Floating-point value expected for option "
+							<< argv[i] << endl;
+					exit(1);
+				}
+			}
+
+			// precision of the stored posterior probabilities
+			else if (!strcmp(argv[i], "-pb")
+					|| !strcmp(argv[i], "--posterior-bits")) {
+				if (i < argc - 1) {
+					if (!GetInteger(argv[++i], &tempInt)) {
+						cerr << "ERROR: Invalid integer following option "
+								<< argv[i - 1] << ": " << argv[i] << endl;
+						exit(1);
+					} else {
+						if (tempInt != 8 && tempInt != 16 && tempInt != 32) {
+							cerr << "ERROR: For option " << argv[i - 1]
+									<< ", integer must be 8, 16 or 32." << endl;
+							exit(1);
+						} else
+							posteriorBits = tempInt;
+					}
+				} else {
+					cerr << "ERROR: Integer expected for option " << argv[i]
+							<< endl;
+					exit(1);
+				}
+			}
+
+			// directory of the posterior spill file
+			else if (!strcmp(argv[i], "-spill")
+					|| !strcmp(argv[i], "--spill-dir")) {
+				if (i < argc - 1) {
+					spillDirectory = argv[++i];
+				} else {
+					cerr << "ERROR: Directory expected for option " << argv[i]
+							<< endl;
+					exit(1);
+				}
+			}
+
+			// resident memory of spilled posterior matrices
+			else if (!strcmp(argv[i], "-sm")
+					|| !strcmp(argv[i], "--spill-memory")) {
+				if (i < argc - 1) {
+					if (!GetInteger(argv[++i], &tempInt)) {
+						cerr << "ERROR: Invalid integer following option "
+								<< argv[i - 1] << ": " << argv[i] << endl;
+						exit(1);
+					} else {
+						if (tempInt < 1) {
+							cerr << "ERROR: For option " << argv[i - 1]
+									<< ", integer must be positive." << endl;
+							exit(1);
+						} else
+							spillMemory = tempInt;
+					}
+				} else {
+					cerr << "ERROR: Integer expected for option " << argv[i]
+							<< endl;
+					exit(1);
+				}
+			}
+
+			// most cells per posterior matrix row
+			else if (!strcmp(argv[i], "-rc")
+					|| !strcmp(argv[i], "--row-cells")) {
+				if (i < argc - 1) {
+					if (!GetInteger(argv[++i], &tempInt)) {
+						cerr << "ERROR: Invalid integer following option "
+								<< argv[i - 1] << ": " << argv[i] << endl;
+						exit(1);
+					} else {
+						if (tempInt < 1) {
+							cerr << "ERROR: For option " << argv[i - 1]
+									<< ", integer must be positive." << endl;
+							exit(1);
+						} else
+							rowCellCap = tempInt;
+					}
+				} else {
+					cerr << "ERROR: Integer expected for option " << argv[i]
+							<< endl;
+					exit(1);
+				}
+			}
+
+			// fraction of the mass of a posterior matrix row kept
+			else if (!strcmp(argv[i], "-rm")
+					|| !strcmp(argv[i], "--row-mass")) {
+				if (i < argc - 1) {
+					if (!GetFloat(argv[++i], &tempFloat)) {
+						cerr << "ERROR: Invalid floating-point value following option "
+								<< argv[i - 1] << ": " << argv[i] << endl;
+						exit(1);
+					} else {
+						if (tempFloat <= 0 || tempFloat > 1) {
+							cerr << "ERROR: For option " << argv[i - 1]
+									<< ", floating-point value must be greater than 0 and at most 1."
+									<< endl;
+							exit(1);
+						} else
+							rowMassCap = tempFloat;
+					}
+				} else {
+					cerr << "ERROR: Floating-point value expected for option "
+							<< argv[i] << endl;
+					exit(1);
+				}
+			}
+
+			// most cells per posterior matrix
+			else if (!strcmp(argv[i], "-pc")
+					|| !strcmp(argv[i], "--pair-cells")) {
+				if (i < argc - 1) {
+					if (!GetInteger(argv[++i], &tempInt)) {
+						cerr << "ERROR: Invalid integer following option "
+								<< argv[i - 1] << ": " << argv[i] << endl;
+						exit(1);
+					} else {
+						if (tempInt < 1) {
+							cerr << "ERROR: For option " << argv[i - 1]
+									<< ", integer must be positive." << endl;
+							exit(1);
+						} else
+							pairCellCap = tempInt;
+					}
+				} else {
+					cerr << "ERROR: Integer expected for option " << argv[i]
+							<< endl;
+					exit(1);
+				}
+			}
+
 			// annotation files
 			else if (!strcmp(argv[i], "-annot")) {
 				enableAnnotation = true;
@@ -897,6 +1250,10 @@ SafeVector<string> MSA::ParseParams(int argc, char **argv) {
 
 	/*check the output file name*/
 	//cerr << "-------------------------------------" << endl;
+	if (mpiRank > 0) {
+		// only the first MPI rank writes the alignment
+		alignOutFileName = "";
+	}
 	if (alignOutFileName.length() == 0) {
 		cerr << "The final alignments will be printed out to STDOUT" << endl;
 		alignOutFile = &std::cout;
@@ -913,27 +1270,46 @@ SafeVector<string> MSA::ParseParams(int argc, char **argv) {
 // ProcessTree()
 //
 // Process the tree recursively.  Returns the aligned sequences
-// corresponding to a node or leaf of the tree.
+// corresponding to a node or leaf of the tree.  With aggregates,
+// the aggregate of every merged profile is stored under the index
+// of its node until its parent is merged.
 /////////////////////////////////////////////////////////////////
 
 MultiSequence* MSA::ProcessTree(TreeNode *tree, MultiSequence *sequences,
-		const SafeVector<SafeVector<SparseMatrix *> > &sparseMatrices,
-		const ProbabilisticModel &model) {
+		const PairMatrixStore &sparseMatrices,
+		const ProbabilisticModel &model,
+		const SafeVector<MultiSequence*> *subtreeAlignments,
+		SafeVector<ProfileAggregate*> *aggregates) {
 
 	MultiSequence *result;
 
+	// use the alignment of the subtree if it was computed already
+	if (subtreeAlignments && (*subtreeAlignments)[tree->idx])
+		return (*subtreeAlignments)[tree->idx];
+
 	// check if this is a node of the alignment tree
 	//if (tree->GetSequenceLabel() == -1){
 	if (tree->leaf == NODE) {
 		MultiSequence *alignLeft = ProcessTree(tree->left, sequences,
-				sparseMatrices, model);
+				sparseMatrices, model, subtreeAlignments, aggregates);
 		MultiSequence *alignRight = ProcessTree(tree->right, sequences,
-				sparseMatrices, model);
+				sparseMatrices, model, subtreeAlignments, aggregates);
 
 		assert(alignLeft);
 		assert(alignRight);
 
-		result = AlignAlignments(alignLeft, alignRight, sparseMatrices, model);
+		if (aggregates) {
+			ProfileAggregate *&aggregateLeft = (*aggregates)[tree->left->idx];
+			ProfileAggregate *&aggregateRight = (*aggregates)[tree->right->idx];
+			result = AlignAlignments(alignLeft, alignRight, sparseMatrices,
+					model, aggregateLeft, aggregateRight,
+					&(*aggregates)[tree->idx]);
+			delete aggregateLeft;
+			delete aggregateRight;
+			aggregateLeft = aggregateRight = NULL;
+		} else
+			result = AlignAlignments(alignLeft, alignRight, sparseMatrices,
+					model);
 		assert(result);
 
 		delete alignLeft;
@@ -951,6 +1327,86 @@ MultiSequence* MSA::ProcessTree(TreeNode *tree, MultiSequence *sequences,
 	return result;
 }
 
+/////////////////////////////////////////////////////////////////
+// CountLeafs()
+//
+// Stores the number of leafs below every node of the tree.
+/////////////////////////////////////////////////////////////////
+
+static int CountLeafs(TreeNode *tree, VI &numLeafs) {
+	int count = 1;
+	if (tree->leaf == NODE)
+		count = CountLeafs(tree->left, numLeafs)
+				+ CountLeafs(tree->right, numLeafs);
+	numLeafs[tree->idx] = count;
+	return count;
+}
+
+/////////////////////////////////////////////////////////////////
+// CollectSubtrees()
+//
+// Collects the largest subtrees holding at most maxLeafs leafs.
+/////////////////////////////////////////////////////////////////
+
+static void CollectSubtrees(TreeNode *tree, const VI &numLeafs,
+		int maxLeafs, SafeVector<TreeNode*> &subtrees) {
+	if (numLeafs[tree->idx] <= maxLeafs) {
+		subtrees.push_back(tree);
+		return;
+	}
+	CollectSubtrees(tree->left, numLeafs, maxLeafs, subtrees);
+	CollectSubtrees(tree->right, numLeafs, maxLeafs, subtrees);
+}
+
+/////////////////////////////////////////////////////////////////
+// AlignSubtrees()
+//
+// Aligns the small subtrees of the guide tree concurrently, one
+// OpenMP task per subtree, and stores each alignment under the
+// index of the subtree root.  The few large nodes above them are
+// left to ProcessTree(), which aligns them one at a time so that
+// each merge of two large profiles may use all threads.  Every
+// merge is computed exactly as in the serial recursion, so the
+// result does not depend on the number of threads.
+/////////////////////////////////////////////////////////////////
+
+void MSA::AlignSubtrees(MSAGuideTree *tree, MultiSequence *sequences,
+		const PairMatrixStore &sparseMatrices,
+		const ProbabilisticModel &model,
+		SafeVector<MultiSequence*> &subtreeAlignments,
+		SafeVector<ProfileAggregate*> *aggregates) {
+	subtreeAlignments.resize(tree->getNodesNum(), NULL);
+#ifdef _OPENMP
+	// the verbose trace is printed in the order of the serial recursion
+	const int threads = enableVerbose ? 1 : omp_get_max_threads();
+	if (threads <= 1)
+		return;
+
+	VI numLeafs(tree->getNodesNum());
+	const int numLeafsTotal = CountLeafs(tree->getRoot(), numLeafs);
+	const int maxLeafs = max(numLeafsTotal / (TASKS_PER_THREAD * threads), 2);
+
+	SafeVector<TreeNode*> subtrees;
+	CollectSubtrees(tree->getRoot(), numLeafs, maxLeafs, subtrees);
+
+	// start with the largest subtrees, which take longest to align
+	SafeVector<pair<int, int> > order;
+	for (int i = 0; i < (int) subtrees.size(); i++)
+		if (subtrees[i]->leaf == NODE)
+			order.push_back(make_pair(-numLeafs[subtrees[i]->idx], i));
+	sort(order.begin(), order.end());
+
+#pragma omp parallel
+#pragma omp single
+	for (int i = 0; i < (int) order.size(); i++) {
+		TreeNode *subtree = subtrees[order[i].second];
+#pragma omp task firstprivate(subtree) default(shared)
+		subtreeAlignments[subtree->idx] = ProcessTree(subtree, sequences,
+				sparseMatrices, model, NULL, aggregates);
+	}
+#endif
+}
+
 /////////////////////////////////////////////////////////////////
 // ComputeFinalAlignment()
 //
@@ -960,12 +1416,21 @@ MultiSequence* MSA::ProcessTree(TreeNode *tree, MultiSequence *sequences,
 
 MultiSequence* MSA::ComputeFinalAlignment(MSAGuideTree*tree,
 		MultiSequence *sequences,
-		const SafeVector<SafeVector<SparseMatrix *> > &sparseMatrices,
+		const PairMatrixStore &sparseMatrices,
 		const ProbabilisticModel &model, int levelid) {
 
 	startTime = GetTime();
+	SafeVector<MultiSequence*> subtreeAlignments;
+	// subtree aggregates assume that no cutoff is subtracted
+	SafeVector<ProfileAggregate*> aggregates;
+	if (enableAggregatePosteriors && cutoff == 0)
+		aggregates.resize(tree->getNodesNum(), NULL);
+	SafeVector<ProfileAggregate*> *aggregatesPtr =
+			aggregates.empty() ? NULL : &aggregates;
+	AlignSubtrees(tree, sequences, sparseMatrices, model, subtreeAlignments,
+			aggregatesPtr);
 	MultiSequence *alignment = ProcessTree(tree->getRoot(), sequences,
-			sparseMatrices, model);
+			sparseMatrices, model, &subtreeAlignments, aggregatesPtr);
 	timeUsed = GetElapsedTime ( startTime );
  	cerr << "[Main] Profile-Profile alignment used " << timeUsed << " seconds." << endl;
 	double lastUsed = timeUsed;
@@ -1003,13 +1468,17 @@ MultiSequence* MSA::ComputeFinalAlignment(MSAGuideTree*tree,
 /////////////////////////////////////////////////////////////////
 // AlignAlignments()
 //
-// Returns the alignment of two MultiSequence objects.
+// Returns the alignment of two MultiSequence objects.  If either
+// has an aggregate, the profile posterior is built from it, and if
+// merged is given, the aggregate of the result is stored there.
 /////////////////////////////////////////////////////////////////
 
 MultiSequence* MSA::AlignAlignments(MultiSequence *align1,
 		MultiSequence *align2,
-		const SafeVector<SafeVector<SparseMatrix *> > &sparseMatrices,
-		const ProbabilisticModel &model) {
+		const PairMatrixStore &sparseMatrices,
+		const ProbabilisticModel &model,
+		const ProfileAggregate *aggregate1,
+		const ProfileAggregate *aggregate2, ProfileAggregate **merged) {
 
 	// print some info about the alignment
 	if (enableVerbose) {
@@ -1022,18 +1491,36 @@ MultiSequence* MSA::AlignAlignments(MultiSequence *align1,
 					<< align2->GetSequence(i)->GetLabel();
 		cerr << "]: ";
 	}
+
+	// the temporaries of the merge are released together on return
+	ScratchArena &arena = ScratchArena::GetThreadArena();
+	ScratchScope scope(arena);
+
+	ProfilePosterior *posterior;
+	if (aggregate1 || aggregate2)
+		posterior = model.BuildAggregatedPosterior(getSeqsWeights(), align1,
+				aggregate1, align2, aggregate2, sparseMatrices, &arena);
+	else {
 #if 0
-	VF *posterior = model.BuildPosterior (align1, align2, sparseMatrices, cutoff);
+		posterior = model.BuildProfilePosterior (NULL, align1, align2, sparseMatrices, cutoff, samplePairBudget, &arena);
 #else
-	VF *posterior = model.BuildPosterior(getSeqsWeights(), align1, align2,
-			sparseMatrices, cutoff);
+		posterior = model.BuildProfilePosterior(getSeqsWeights(), align1,
+				align2, sparseMatrices, cutoff, samplePairBudget, &arena);
 #endif
+	}
 	// compute an "accuracy" measure for the MSA before refinement
 
 	pair<SafeVector<char> *, float> alignment;
-	//perform alignment
-	alignment = model.ComputeAlignment(align1->GetSequence(0)->GetLength(),
-			align2->GetSequence(0)->GetLength(), *posterior);
+	//perform alignment; the posterior is normalized by the total weight
+	//of the sequence pairs, so that its cells are at most 1
+	if (anchorFraction > 0)
+		alignment = model.ComputeAnchoredAlignment(
+				align1->GetSequence(0)->GetLength(),
+				align2->GetSequence(0)->GetLength(), *posterior,
+				anchorFraction);
+	else
+		alignment = model.ComputeAlignment(align1->GetSequence(0)->GetLength(),
+				align2->GetSequence(0)->GetLength(), *posterior);
 
 	delete posterior;
 
@@ -1052,15 +1539,20 @@ MultiSequence* MSA::AlignAlignments(MultiSequence *align1,
 
 	// now build final alignment
 	MultiSequence *result = new MultiSequence();
+	const VI runs1 = Sequence::GetGapRuns(*alignment.first, 'X');
+	const VI runs2 = Sequence::GetGapRuns(*alignment.first, 'Y');
 	for (int i = 0; i < align1->GetNumSequences(); i++)
-		result->AddSequence(
-				align1->GetSequence(i)->AddGaps(alignment.first, 'X'));
+		result->AddSequence(align1->GetSequence(i)->AddGaps(runs1));
 	for (int i = 0; i < align2->GetNumSequences(); i++)
-		result->AddSequence(
-				align2->GetSequence(i)->AddGaps(alignment.first, 'Y'));
+		result->AddSequence(align2->GetSequence(i)->AddGaps(runs2));
 	if (!enableAlignOrder)
 		result->SortByLabel();
 
+	if (merged)
+		*merged = ProfileAggregate::Merge(align1, aggregate1, align2,
+				aggregate2, *alignment.first, sparseMatrices,
+				getSeqsWeights());
+
 	// free temporary alignment
 	delete alignment.first;
 
@@ -1071,22 +1563,37 @@ MultiSequence* MSA::AlignAlignments(MultiSequence *align1,
 // DoRelaxation()
 //
 // Performs one round of the weighted probabilistic consistency transformation.
-//                     
+// The relaxed matrices are written to the spare arena of the store.
 /////////////////////////////////////////////////////////////////
 
-SafeVector<SafeVector<SparseMatrix *> > MSA::DoRelaxation(float* seqsWeights,
-		MultiSequence *sequences,
-		SafeVector<SafeVector<SparseMatrix *> > &sparseMatrices) {
+void MSA::DoRelaxation(float* seqsWeights, MultiSequence *sequences,
+		PairMatrixStore &sparseMatrices) {
 	const int numSeqs = sequences->GetNumSequences();
 
-	SafeVector<SafeVector<SparseMatrix *> > newSparseMatrices(numSeqs,
-			SafeVector<SparseMatrix *>(numSeqs, NULL));
+	sparseMatrices.PrepareNext();
+
+	// scratch posterior and transpose matrices of every thread
+#ifdef _OPENMP
+	const int numScratch = omp_get_max_threads();
+#else
+	const int numScratch = 1;
+#endif
+	SafeVector<VF> posteriors(numScratch);
+	SparseMatrix *transposes = new SparseMatrix[numScratch];
+
+	// scratch for values decoded from a quantized store
+	SafeVector<VF> valuesXY(numScratch), valuesIK(numScratch),
+			valuesKJ(numScratch), valuesNew(numScratch);
+
+	// with MPI, this rank relaxes only its own share of the pairs
+	const int firstPair = sparseMatrices.GetShareStart(mpiRank, mpiSize);
+	const int lastPair = sparseMatrices.GetShareStart(mpiRank + 1, mpiSize);
 
 	// for every pair of sequences
 #ifdef _OPENMP
 	int pairIdx;
 #pragma omp parallel for private(pairIdx) default(shared) schedule(dynamic)
-	for(pairIdx = 0; pairIdx < numPairs; pairIdx++) {
+	for(pairIdx = firstPair; pairIdx < lastPair; pairIdx++) {
 		int i = seqsPairs[pairIdx].seq1;
 		int j = seqsPairs[pairIdx].seq2;
 		//float wi = seqsWeights[i];
@@ -1096,6 +1603,9 @@ SafeVector<SafeVector<SparseMatrix *> > MSA::DoRelaxation(float* seqsWeights,
 		//float wi = seqsWeights[i];
 		for (int j = i + 1; j < numSeqs; j++) {
 			//float wj = seqsWeights[j];
+			int pairIdx = sparseMatrices.GetPairIndex(i, j);
+			if (pairIdx < firstPair || pairIdx >= lastPair)
+				continue;
 #endif
 			Sequence *seq1 = sequences->GetSequence(i);
 			Sequence *seq2 = sequences->GetSequence(j);
@@ -1108,24 +1618,36 @@ SafeVector<SafeVector<SparseMatrix *> > MSA::DoRelaxation(float* seqsWeights,
 						<< " vs. " << "(" << j + 1 << ") " << seq2->GetHeader()
 						<< ": ";
 			}
+#ifdef _OPENMP
+			const int tid = omp_get_thread_num();
+#else
+			const int tid = 0;
+#endif
 			// get the original posterior matrix
-			VF *posteriorPtr = sparseMatrices[i][j]->GetPosterior();
-			assert(posteriorPtr);
-			VF &posterior = *posteriorPtr;
+			SparseMatrix matXY = sparseMatrices.GetMatrix(i, j, valuesXY[tid]);
+			VF &posterior = posteriors[tid];
+			matXY.GetPosterior(posterior);
 
 			const int seq1Length = seq1->GetLength();
 			const int seq2Length = seq2->GetLength();
 
-			// contribution from the summation where z = x and z = y
+			// contribution from the summation where z = x and z = y,
+			// which is nonzero only at the cells of matXY
 			//float w = wi * wi * wj + wi * wj * wj;
 			//float sumW = w;
-			for (int k = 0; k < (seq1Length + 1) * (seq2Length + 1); k++) {
-                                //posterior[k] = w*posterior[k];
-				posterior[k] += posterior[k];
+			for (int x = 1; x <= seq1Length; x++) {
+				const unsigned char *XYcolumns = matXY.GetColumnPtr(x);
+				const int XYsize = matXY.GetRowSize(x);
+				VF::iterator cell = posterior.begin() + x * (seq2Length + 1);
+				for (int c = 0; c < XYsize; c++) {
+					cell += XYcolumns[c];
+					//*cell = w * *cell;
+					*cell += *cell;
+				}
 			}
 
 			if (enableVerbose)
-				cerr << sparseMatrices[i][j]->GetNumCells() << " --> ";
+				cerr << matXY.GetNumCells() << " --> ";
 
 			// contribution from all other sequences
 			for (int k = 0; k < numSeqs; k++) {
@@ -1133,60 +1655,46 @@ SafeVector<SafeVector<SparseMatrix *> > MSA::DoRelaxation(float* seqsWeights,
 					//float wk = seqsWeights[k];
 					//float w = wi * wj * wk;
 					//sumW += w;
+					SparseMatrix matIK = sparseMatrices.GetView(i, k,
+							valuesIK[tid]).GetMatrix();
+					SparseMatrix matKJ = sparseMatrices.GetView(k, j,
+							valuesKJ[tid]).GetMatrix();
 					if (k < i)
-						Relax1(sparseMatrices[k][i], sparseMatrices[k][j],posterior);
+						Relax1(&matIK, &matKJ,posterior);
 					else if (k > i && k < j)
-						Relax(sparseMatrices[i][k], sparseMatrices[k][j],posterior);
+						Relax(&matIK, &matKJ,posterior);
 					else {
-						SparseMatrix *temp = sparseMatrices[j][k]->ComputeTranspose();
-						Relax(sparseMatrices[i][k], temp, posterior);
-						delete temp;
+						matKJ.ComputeTranspose(transposes[tid]);
+						Relax(&matIK, &transposes[tid], posterior);
 					}
 				}
 			}
 			//cerr<<"sumW "<<sumW<<endl;
-			for (int k = 0; k < (seq1Length + 1) * (seq2Length + 1); k++) {
-				//posterior[k] /= sumW;
-				posterior[k] /= numSeqs;
-			}
-			// mask out positions not originally in the posterior matrix
-			SparseMatrix *matXY = sparseMatrices[i][j];
-			for (int y = 0; y <= seq2Length; y++)
-				posterior[y] = 0;
-			for (int x = 1; x <= seq1Length; x++) {
-				SafeVector<PIF>::iterator XYptr = matXY->GetRowPtr(x);
-				SafeVector<PIF>::iterator XYend = XYptr + matXY->GetRowSize(x);
-				VF::iterator base = posterior.begin() + x * (seq2Length + 1);
-				int curr = 0;
-				while (XYptr != XYend) {
-
-					// zero out all cells until the first filled column
-					while (curr < XYptr->first) {
-						base[curr] = 0;
-						curr++;
-					}
-
-					// now, skip over this column
-					curr++;
-					++XYptr;
-				}
 
-				// zero out cells after last column
-				while (curr <= seq2Length) {
-					base[curr] = 0;
-					curr++;
+			// normalize the cells originally in the posterior matrix and
+			// mask out the other cells of its layout; StoreNext() reads
+			// no cells outside the layout
+			for (int x = 1; x <= seq1Length; x++) {
+				const unsigned char *XYcolumns = matXY.GetColumnPtr(x);
+				const float *XYvalues = matXY.GetValuePtr(x);
+				const int XYsize = matXY.GetRowSize(x);
+				VF::iterator cell = posterior.begin() + x * (seq2Length + 1);
+				for (int c = 0; c < XYsize; c++) {
+					cell += XYcolumns[c];
+					if (XYvalues[c] == 0)
+						*cell = 0;
+					else
+						//*cell /= sumW;
+						*cell /= numSeqs;
 				}
 			}
 
 			// save the new posterior matrix
-			newSparseMatrices[i][j] = new SparseMatrix(seq1->GetLength(),
-					seq2->GetLength(), posterior);
-			newSparseMatrices[j][i] = NULL;
+			SparseMatrix matNew = sparseMatrices.StoreNext(i, j, posterior,
+					valuesNew[tid]);
 
 			if (enableVerbose)
-				cerr << newSparseMatrices[i][j]->GetNumCells() << " -- ";
-
-			delete posteriorPtr;
+				cerr << matNew.GetNumCells() << " -- ";
 
 			if (enableVerbose)
 				cerr << "done." << endl;
@@ -1195,7 +1703,12 @@ SafeVector<SafeVector<SparseMatrix *> > MSA::DoRelaxation(float* seqsWeights,
 #endif
 	}
 
-	return newSparseMatrices;
+	delete[] transposes;
+
+#ifdef GLPROBS_MPI
+	// collect the shares relaxed by the other ranks
+	sparseMatrices.ShareNext(MPI_COMM_WORLD);
+#endif
 }
 
 /////////////////////////////////////////////////////////////////
@@ -1218,24 +1731,27 @@ void MSA::Relax(float weight, SparseMatrix *matXZ, SparseMatrix *matZY,
 
 	// for every x[i]
 	for (int i = 1; i <= lengthX; i++) {
-		SafeVector<PIF>::iterator XZptr = matXZ->GetRowPtr(i);
-		SafeVector<PIF>::iterator XZend = XZptr + matXZ->GetRowSize(i);
+		const unsigned char *XZcolumns = matXZ->GetColumnPtr(i);
+		const float *XZvalues = matXZ->GetValuePtr(i);
+		const int XZsize = matXZ->GetRowSize(i);
 
 		VF::iterator base = posterior.begin() + i * (lengthY + 1);
 
 		// iterate through all x[i]-z[k]
-		while (XZptr != XZend) {
-			SafeVector<PIF>::iterator ZYptr = matZY->GetRowPtr(XZptr->first);
-			SafeVector<PIF>::iterator ZYend = ZYptr
-					+ matZY->GetRowSize(XZptr->first);
-			const float XZval = XZptr->second;
+		int k = 0;
+		for (int c = 0; c < XZsize; c++) {
+			k += XZcolumns[c];
+			const unsigned char *ZYcolumns = matZY->GetColumnPtr(k);
+			const float *ZYvalues = matZY->GetValuePtr(k);
+			const int ZYsize = matZY->GetRowSize(k);
+			const float XZval = XZvalues[c];
 
 			// iterate through all z[k]-y[j]
-			while (ZYptr != ZYend) {
-				base[ZYptr->first] += weight * XZval * ZYptr->second;
-				ZYptr++;
+			VF::iterator cell = base;
+			for (int d = 0; d < ZYsize; d++) {
+				cell += ZYcolumns[d];
+				*cell += weight * XZval * ZYvalues[d];
 			}
-			XZptr++;
 		}
 	}
 }
@@ -1253,24 +1769,27 @@ void MSA::Relax(SparseMatrix *matXZ, SparseMatrix *matZY,
 
 	// for every x[i]
 	for (int i = 1; i <= lengthX; i++) {
-		SafeVector<PIF>::iterator XZptr = matXZ->GetRowPtr(i);
-		SafeVector<PIF>::iterator XZend = XZptr + matXZ->GetRowSize(i);
+		const unsigned char *XZcolumns = matXZ->GetColumnPtr(i);
+		const float *XZvalues = matXZ->GetValuePtr(i);
+		const int XZsize = matXZ->GetRowSize(i);
 
 		VF::iterator base = posterior.begin() + i * (lengthY + 1);
 
 		// iterate through all x[i]-z[k]
-		while (XZptr != XZend) {
-			SafeVector<PIF>::iterator ZYptr = matZY->GetRowPtr(XZptr->first);
-			SafeVector<PIF>::iterator ZYend = ZYptr
-					+ matZY->GetRowSize(XZptr->first);
-			const float XZval = XZptr->second;
+		int k = 0;
+		for (int c = 0; c < XZsize; c++) {
+			k += XZcolumns[c];
+			const unsigned char *ZYcolumns = matZY->GetColumnPtr(k);
+			const float *ZYvalues = matZY->GetValuePtr(k);
+			const int ZYsize = matZY->GetRowSize(k);
+			const float XZval = XZvalues[c];
 
 			// iterate through all z[k]-y[j]
-			while (ZYptr != ZYend) {
-                                base[ZYptr->first] += XZval * ZYptr->second;
-				ZYptr++;
+			VF::iterator cell = base;
+			for (int d = 0; d < ZYsize; d++) {
+				cell += ZYcolumns[d];
+				*cell += XZval * ZYvalues[d];
 			}
-			XZptr++;
 		}
 	}
 }
@@ -1293,23 +1812,25 @@ void MSA::Relax1(float weight, SparseMatrix *matZX, SparseMatrix *matZY,VF &post
 
 	// for every z[k]
 	for (int k = 1; k <= lengthZ; k++) {
-		SafeVector<PIF>::iterator ZXptr = matZX->GetRowPtr(k);
-		SafeVector<PIF>::iterator ZXend = ZXptr + matZX->GetRowSize(k);
+		const unsigned char *ZXcolumns = matZX->GetColumnPtr(k);
+		const float *ZXvalues = matZX->GetValuePtr(k);
+		const int ZXsize = matZX->GetRowSize(k);
+		const unsigned char *ZYcolumns = matZY->GetColumnPtr(k);
+		const float *ZYvalues = matZY->GetValuePtr(k);
+		const int ZYsize = matZY->GetRowSize(k);
 
 		// iterate through all z[k]-x[i]
-		while (ZXptr != ZXend) {
-			SafeVector<PIF>::iterator ZYptr = matZY->GetRowPtr(k);
-			SafeVector<PIF>::iterator ZYend = ZYptr + matZY->GetRowSize(k);
-			const float ZXval = ZXptr->second;
-			VF::iterator base = posterior.begin()
-					+ ZXptr->first * (lengthY + 1);
+		int i = 0;
+		for (int c = 0; c < ZXsize; c++) {
+			i += ZXcolumns[c];
+			const float ZXval = ZXvalues[c];
+			VF::iterator cell = posterior.begin() + i * (lengthY + 1);
 
 			// iterate through all z[k]-y[j]
-			while (ZYptr != ZYend) {
-				base[ZYptr->first] += weight * ZXval * ZYptr->second;
-				ZYptr++;
+			for (int d = 0; d < ZYsize; d++) {
+				cell += ZYcolumns[d];
+				*cell += weight * ZXval * ZYvalues[d];
 			}
-			ZXptr++;
 		}
 	}
 }
@@ -1325,23 +1846,25 @@ void MSA::Relax1(SparseMatrix *matZX, SparseMatrix *matZY,VF &posterior) {
 
 	// for every z[k]
 	for (int k = 1; k <= lengthZ; k++) {
-		SafeVector<PIF>::iterator ZXptr = matZX->GetRowPtr(k);
-		SafeVector<PIF>::iterator ZXend = ZXptr + matZX->GetRowSize(k);
+		const unsigned char *ZXcolumns = matZX->GetColumnPtr(k);
+		const float *ZXvalues = matZX->GetValuePtr(k);
+		const int ZXsize = matZX->GetRowSize(k);
+		const unsigned char *ZYcolumns = matZY->GetColumnPtr(k);
+		const float *ZYvalues = matZY->GetValuePtr(k);
+		const int ZYsize = matZY->GetRowSize(k);
 
 		// iterate through all z[k]-x[i]
-		while (ZXptr != ZXend) {
-			SafeVector<PIF>::iterator ZYptr = matZY->GetRowPtr(k);
-			SafeVector<PIF>::iterator ZYend = ZYptr + matZY->GetRowSize(k);
-			const float ZXval = ZXptr->second;
-			VF::iterator base = posterior.begin()
-					+ ZXptr->first * (lengthY + 1);
+		int i = 0;
+		for (int c = 0; c < ZXsize; c++) {
+			i += ZXcolumns[c];
+			const float ZXval = ZXvalues[c];
+			VF::iterator cell = posterior.begin() + i * (lengthY + 1);
 
 			// iterate through all z[k]-y[j]
-			while (ZYptr != ZYend) {
-				base[ZYptr->first] += ZXval * ZYptr->second;
-				ZYptr++;
+			for (int d = 0; d < ZYsize; d++) {
+				cell += ZYcolumns[d];
+				*cell += ZXval * ZYvalues[d];
 			}
-			ZXptr++;
 		}
 	}
 }
@@ -1355,7 +1878,7 @@ void MSA::Relax1(SparseMatrix *matZX, SparseMatrix *matZY,VF &posterior) {
 /////////////////////////////////////////////////////////////////
 
 int MSA::DoIterativeRefinement(
-		const SafeVector<SafeVector<SparseMatrix *> > &sparseMatrices,
+		const PairMatrixStore &sparseMatrices,
 		const ProbabilisticModel &model, MultiSequence* &alignment) {
 	set<int> groupOne, groupTwo;
 	int numSeqs = alignment->GetNumSequences();
@@ -1377,47 +1900,28 @@ int MSA::DoIterativeRefinement(
 	MultiSequence *groupTwoSeqs = alignment->Project(groupTwo);
 	assert(groupTwoSeqs);	
 
+	// the temporaries of the refinement are released together on return
+	ScratchArena &arena = ScratchArena::GetThreadArena();
+	ScratchScope scope(arena);
+
 //no weight profile-profile for refinement
 #if 1
-	VF *posterior = model.BuildPosterior (groupOneSeqs, groupTwoSeqs, sparseMatrices, cutoff);
+	ProfilePosterior *posterior = model.BuildProfilePosterior (NULL, groupOneSeqs, groupTwoSeqs, sparseMatrices, cutoff, samplePairBudget, &arena);
 #else
-	VF *posterior = model.BuildPosterior(getSeqsWeights(), groupOneSeqs, groupTwoSeqs,
-			sparseMatrices, cutoff);
+	ProfilePosterior *posterior = model.BuildProfilePosterior(getSeqsWeights(),
+			groupOneSeqs, groupTwoSeqs, sparseMatrices, cutoff, samplePairBudget, &arena);
 #endif
-	// compute an "accuracy" for the currrent MSA before refinement        
-        SafeVector<SafeVector<char>::iterator> oldOnePtrs(groupOne.size());
-	SafeVector<SafeVector<char>::iterator> oldTwoPtrs(groupTwo.size());
-        i=0; 
-	for (set<int>::const_iterator iter = groupOne.begin();
-			iter != groupOne.end(); ++iter) {
-		oldOnePtrs[i++] = alignment->GetSequence(*iter)->GetDataPtr();
-	}
-        i=0;
-	for (set<int>::const_iterator iter = groupTwo.begin();
-			iter != groupTwo.end(); ++iter) {
-		oldTwoPtrs[i++] = alignment->GetSequence(*iter)->GetDataPtr();
-	}
+	// compute an "accuracy" for the currrent MSA before refinement
+	VI columnsOne, columnsTwo;
+	alignment->GetProjectionColumns(groupOne, columnsOne);
+	alignment->GetProjectionColumns(groupTwo, columnsTwo);
+	float accuracy_before = 0;
+	for (i = 1; i < (int) columnsOne.size(); i++)
+		if (columnsOne[i] != columnsOne[i - 1]
+				&& columnsTwo[i] != columnsTwo[i - 1])
+			accuracy_before += posterior->GetValue(columnsOne[i],
+					columnsTwo[i]);
 
-        VF &posteriorArr = *posterior;
-        int oldLength = alignment->GetSequence(0)->GetLength();
-	int groupOneindex=0; int groupTwoindex=0;
-	float accuracy_before = 0; 
-        int j;
-	for (i = 1; i <= oldLength; i++) {
-		// check to see if there is a gap in every sequence of the set
-		bool foundOne = false;
-		for (j = 0; !foundOne && j < (int) groupOne.size(); j++)
-			foundOne = (oldOnePtrs[j][i] != '-');
-		// if not, then this column counts towards the sequence length
-		if (foundOne) groupOneindex ++;
-		bool foundTwo = false;
-		for (j = 0; !foundTwo && j < (int) groupTwo.size(); j++)
-			foundTwo = (oldTwoPtrs[j][i] != '-');
-		if (foundTwo) groupTwoindex ++;
-                if(foundOne && foundTwo) accuracy_before += 
-				posteriorArr[groupOneindex * (groupTwoSeqs->GetSequence(0)->GetLength() + 1) + groupTwoindex];
-	}
-       
 	pair<SafeVector<char> *, float> refinealignment;
 	//perform alignment
 	refinealignment = model.ComputeAlignment(groupOneSeqs->GetSequence(0)->GetLength(),
@@ -1425,12 +1929,12 @@ int MSA::DoIterativeRefinement(
         delete posterior;
 	// now build final alignment
 	MultiSequence *result = new MultiSequence();
+	const VI runsOne = Sequence::GetGapRuns(*refinealignment.first, 'X');
+	const VI runsTwo = Sequence::GetGapRuns(*refinealignment.first, 'Y');
 	for (int i = 0; i < groupOneSeqs->GetNumSequences(); i++)
-		result->AddSequence(
-			groupOneSeqs->GetSequence(i)->AddGaps(refinealignment.first, 'X'));
+		result->AddSequence(groupOneSeqs->GetSequence(i)->AddGaps(runsOne));
 	for (int i = 0; i < groupTwoSeqs->GetNumSequences(); i++)
-		result->AddSequence(
-			groupTwoSeqs->GetSequence(i)->AddGaps(refinealignment.first, 'Y'));
+		result->AddSequence(groupTwoSeqs->GetSequence(i)->AddGaps(runsTwo));
 	// free temporary alignment
 	delete refinealignment.first;
 	delete alignment;
@@ -1443,7 +1947,7 @@ int MSA::DoIterativeRefinement(
 
 
 void MSA::DoIterativeRefinementTreeNode(
-		const SafeVector<SafeVector<SparseMatrix *> > &sparseMatrices,
+		const PairMatrixStore &sparseMatrices,
 		const ProbabilisticModel &model, MultiSequence* &alignment,
 		int nodeIndex) {
 	set<int> groupOne, groupTwo;
@@ -1499,7 +2003,7 @@ void MSA::DoIterativeRefinementTreeNode(
 /////////////////////////////////////////////////////////////////
 
 void MSA::WriteAnnotation(MultiSequence *alignment,
-		const SafeVector<SafeVector<SparseMatrix *> > &sparseMatrices) {
+		const PairMatrixStore &sparseMatrices) {
 	ofstream outfile(annotationFilename.c_str());
 
 	if (outfile.fail()) {
@@ -1511,9 +2015,12 @@ void MSA::WriteAnnotation(MultiSequence *alignment,
 	const int numSeqs = alignment->GetNumSequences();
 
 	SafeVector<int> position(numSeqs, 0);
-	SafeVector<SafeVector<char>::iterator> seqs(numSeqs);
-	for (int i = 0; i < numSeqs; i++)
-		seqs[i] = alignment->GetSequence(i)->GetDataPtr();
+	SafeVector<const int *> mappings(numSeqs);
+	SafeVector<int> lengths(numSeqs);
+	for (int i = 0; i < numSeqs; i++) {
+		mappings[i] = alignment->GetMapping(i);
+		lengths[i] = alignment->GetMappingLength(i);
+	}
 	SafeVector<pair<int, int> > active;
 	active.reserve(numSeqs);
 
@@ -1527,7 +2034,7 @@ void MSA::WriteAnnotation(MultiSequence *alignment,
 		// find all aligned residues in this particular column
 		active.clear();
 		for (int j = 0; j < numSeqs; j++) {
-			if (seqs[j][i] != '-') {
+			if (position[j] < lengths[j] && mappings[j][position[j] + 1] == i) {
 				active.push_back(make_pair(lab[j], ++position[j]));
 			}
 		}
@@ -1546,7 +2053,7 @@ void MSA::WriteAnnotation(MultiSequence *alignment,
 /////////////////////////////////////////////////////////////////
 
 int MSA::ComputeScore(const SafeVector<pair<int, int> > &active,
-		const SafeVector<SafeVector<SparseMatrix *> > &sparseMatrices) {
+		const PairMatrixStore &sparseMatrices) {
 
 	if (active.size() <= 1)
 		return 0;
@@ -1556,7 +2063,7 @@ int MSA::ComputeScore(const SafeVector<pair<int, int> > &active,
 	float val = 0;
 	for (int i = 0; i < (int) active.size(); i++) {
 		for (int j = i + 1; j < (int) active.size(); j++) {
-			val += sparseMatrices[active[i].first][active[j].first]->GetValue(
+			val += sparseMatrices.GetView(active[i].first, active[j].first).GetValue(
 					active[i].second, active[j].second);
 		}
 	}
@@ -8,6 +8,7 @@
 #include "ScoreType.h"
 #include "ProbabilisticModel.h"
 #include "SparseMatrix.h"
+#include "PairMatrixStore.h"
 #include <string>
 
 using namespace std;
@@ -56,20 +57,28 @@ private:
 			const ProbabilisticModel &model, int levelid);
 	void ReadParameters();
 	MultiSequence* ProcessTree(TreeNode *tree, MultiSequence *sequences,
-			const SafeVector<SafeVector<SparseMatrix *> > &sparseMatrices,
-			const ProbabilisticModel &model);
+			const PairMatrixStore &sparseMatrices,
+			const ProbabilisticModel &model,
+			const SafeVector<MultiSequence*> *subtreeAlignments = NULL,
+			SafeVector<ProfileAggregate*> *aggregates = NULL);
+	void AlignSubtrees(MSAGuideTree *tree, MultiSequence *sequences,
+			const PairMatrixStore &sparseMatrices,
+			const ProbabilisticModel &model,
+			SafeVector<MultiSequence*> &subtreeAlignments,
+			SafeVector<ProfileAggregate*> *aggregates);
 	MultiSequence *ComputeFinalAlignment(MSAGuideTree *tree,
 			MultiSequence *sequences,
-			const SafeVector<SafeVector<SparseMatrix *> > &sparseMatrices,
+			const PairMatrixStore &sparseMatrices,
 			const ProbabilisticModel &model,int levelid);
 	MultiSequence *AlignAlignments(MultiSequence *align1, MultiSequence *align2,
-			const SafeVector<SafeVector<SparseMatrix *> > &sparseMatrices,
-			const ProbabilisticModel &model);
-	SafeVector<SafeVector<SparseMatrix *> > DoRelaxation(float* seqsWeights,
-			MultiSequence *sequences,
-			SafeVector<SafeVector<SparseMatrix *> > &sparseMatrices);
-	SafeVector<SafeVector<SparseMatrix *> > DoRelaxation( MultiSequence *sequences,
-			SafeVector<SafeVector<SparseMatrix *> > &sparseMatrices);
+			const PairMatrixStore &sparseMatrices,
+			const ProbabilisticModel &model,
+			const ProfileAggregate *aggregate1 = NULL,
+			const ProfileAggregate *aggregate2 = NULL,
+			ProfileAggregate **merged = NULL);
+	void DoRelaxation(float* seqsWeights, MultiSequence *sequences,
+			PairMatrixStore &sparseMatrices);
+	void DoRelaxation(MultiSequence *sequences, PairMatrixStore &sparseMatrices);
 
 	void Relax(float weight, SparseMatrix *matXZ, SparseMatrix *matZY,VF &posterior);//weight 
 	void Relax1(float weight, SparseMatrix *matXZ, SparseMatrix *matZY,VF &posterior);//weight 
@@ -77,16 +86,16 @@ private:
 	void Relax1(SparseMatrix *matXZ, SparseMatrix *matZY,VF &posterior);//unweight 
 
 	int DoIterativeRefinement(
-			const SafeVector<SafeVector<SparseMatrix *> > &sparseMatrices,
+			const PairMatrixStore &sparseMatrices,
 			const ProbabilisticModel &model, MultiSequence* &alignment);
 	void DoIterativeRefinementTreeNode(
-			const SafeVector<SafeVector<SparseMatrix *> > &sparseMatrices,
+			const PairMatrixStore &sparseMatrices,
 			const ProbabilisticModel &model, MultiSequence* &alignment,
 			int nodeIndex);
 	void WriteAnnotation(MultiSequence *alignment,
-			const SafeVector<SafeVector<SparseMatrix *> > &sparseMatrices);
+			const PairMatrixStore &sparseMatrices);
 	int ComputeScore(const SafeVector<pair<int, int> > &active,
-			const SafeVector<SafeVector<SparseMatrix *> > &sparseMatrices);
+			const PairMatrixStore &sparseMatrices);
     int AdjustmentTest( MultiSequence *sequences,const ProbabilisticModel &model );//Determine the Model
 #ifdef _OPENMP
 	//private struct
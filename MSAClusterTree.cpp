@@ -5,9 +5,11 @@
 //
 /////////////////////////////////////////////////////////////////
 
+#include <algorithm>
 #include "MSAClusterTree.h"
 
-MSAClusterTree::MSAClusterTree(MSA* msa, VVF& distMatrix, int numSeqs) :
+MSAClusterTree::MSAClusterTree(MSA* msa, DistanceMatrix& distMatrix,
+		int numSeqs) :
 		MSAGuideTree(msa, distMatrix, numSeqs) {
 }
 
@@ -15,7 +17,7 @@ MSAClusterTree::~MSAClusterTree() {
 }
 
 void MSAClusterTree::create() {
-	//generate the neighbor-joining tree
+	//generate the UPGMA tree
 	this->generateClusterTree();
 
 	//calculate sequence weights
@@ -27,7 +29,7 @@ void MSAClusterTree::create() {
 
 //new add
 void MSAClusterTree::create(int varianceid) {
-	//generate the neighbor-joining tree
+	//generate the UPGMA tree
 	this->generateClusterTree(varianceid);
 
 	//calculate sequence weights
@@ -37,176 +39,100 @@ void MSAClusterTree::create(int varianceid) {
 	this->createAlignmentOrders();
 }
 
-void MSAClusterTree::generateClusterTree() {
-	int i;
-	ValidNode* validNodes, *headValidNodes;
-	ValidNode* miniPtr, *minjPtr, *ivalid, *jvalid;
-	int mini, minj;
-	float* joins;
-	unsigned int* clusterLeafs;
+/////////////////////////////////////////////////////////////////
+// Average-linkage clustering
+//
+// Every valid cluster n keeps its nearest neighbour, the closest
+// valid cluster of lower index, so the closest pair is found among
+// the neighbours alone instead of by rescanning the distance
+// matrix.  After a join only the clusters whose neighbour was one
+// of the joined clusters are rescanned, which makes the usual cost
+// O(N^2) rather than O(N^3).  Pairs are joined in exactly the order,
+// and with exactly the distances, of a full rescan: the closest
+// pair wins, and ties go to the lowest index n and then to the
+// lowest index of its neighbour.
+/////////////////////////////////////////////////////////////////
 
-	//initialize the valid nodes link list
-	validNodes = new ValidNode[leafsNum + 1];
-	joins = new float[leafsNum + 1];
-	clusterLeafs = new unsigned int[nodesNum + 1];
-	if (!validNodes || !joins || !clusterLeafs) {
-		cerr << "Out of memory of the reconstruction of cluster tree" << endl;
-	}
-	//initialize cluster size 
-	for (i = 0; i < this->leafsNum; i++) {
-		clusterLeafs[i] = 1;
-	}
+//the number of valid clusters from which distance updates run in parallel
+const int PARALLEL_JOIN_CLUSTERS = 1024;
 
-	headValidNodes = &validNodes[0];
-	headValidNodes->next = &validNodes[1];
-	headValidNodes->n = -1;
-	headValidNodes->node = -1;
-	headValidNodes->prev = NULL;
+/////////////////////////////////////////////////////////////////
+// getClusterDistance()
+//
+// Returns the distance of clusters i and j, clamped to zero.
+/////////////////////////////////////////////////////////////////
 
-	//build an initial link list
-	ValidNode* curr = &validNodes[1];
-	ValidNode* prev = headValidNodes;
-	ValidNode* next = &validNodes[2];
-	for (i = 0; i < leafsNum; i++) {
-		curr->n = i;
-		curr->node = i;
-		curr->prev = prev;
-		curr->next = next;
-		prev = curr;
-		curr = next;
-		next++;
+static float getClusterDistance(DistanceMatrix &distMatrix, int i,
+		int j) {
+	float dist = distMatrix(i, j);
+	if (dist < 0) {
+#ifdef _OPENMP
+#pragma omp critical
+#endif
+		cerr << "ERROR: It is impossible to have distance value less than zero"
+				<< endl;
+		dist = 0;
 	}
-	prev->next = NULL;
-
-	//to generate the cluster tree
-	int nodeIdx;	//the index of an internal node
-	int firstNode = leafsNum;	//the index of the first internal node
-	int lastNode = firstNode + leafsNum - 1;//the index of the last internal node
-
-	for (nodeIdx = firstNode; nodeIdx < lastNode; nodeIdx++) {
-		//find closest pair of clusters
-		float minDist = 1.1f;
-		miniPtr = headValidNodes;
-		minjPtr = headValidNodes;
-
-		for (ivalid = headValidNodes->next; ivalid != NULL;
-				ivalid = ivalid->next) {
-			mini = ivalid->n;
-			
-			for (jvalid = headValidNodes->next;
-					jvalid != NULL && jvalid->n < mini; jvalid = jvalid->next) {
-				minj = jvalid->n;
-				float dist = (*distMatrix)[mini][minj];
-				if (dist < 0) {
-					cerr
-							<< "ERROR: It is impossible to have distance value less than zero"
-							<< endl;
-					dist = 0;
-				}
-				if (dist < minDist) {
-					minDist = dist;
-					miniPtr = ivalid;
-					minjPtr = jvalid;
-				}
-				//printf("dist %g mini %d minj %d\n", dist, ivalid->node, jvalid->node);
-			}
-		}
-		//printf("**** mini %d minj %d minDist %g *****\n", miniPtr->node, minjPtr->node, minDist);
-		//check the validity of miniPtr and minjPtr;
-		if (miniPtr == headValidNodes || minjPtr == headValidNodes) {
-			cerr << "OOPS: Error occurred while constructing the cluster tree\n"
-					<< endl;
-			exit(-1);
-		}
-		//computing branch length and join the two nodes
-		float branchLength = minDist * 0.5f;
-		this->connectNodes(&nodes[nodeIdx], nodeIdx, &nodes[miniPtr->node],
-				branchLength, &nodes[minjPtr->node], branchLength);
-		clusterLeafs[nodeIdx] = clusterLeafs[miniPtr->node]
-				+ clusterLeafs[minjPtr->node];
-
-		//remove the valid node minjPtr from the list
-		minjPtr->prev->next = minjPtr->next;
-		if (minjPtr->next != NULL) {
-			minjPtr->next->prev = minjPtr->prev;
-		}
-		minjPtr->prev = minjPtr->next = NULL;
-
-		//compute the distance of each remaining valid node to the new node
-		for (ivalid = headValidNodes->next; ivalid != NULL;
-				ivalid = ivalid->next) {
-			int idx = ivalid->n;
-
-			float idist = (*distMatrix)[miniPtr->n][idx];
-			float jdist = (*distMatrix)[minjPtr->n][idx];
+	return dist;
+}
 
-			unsigned int isize = clusterLeafs[miniPtr->node];
-			unsigned int jsize = clusterLeafs[minjPtr->node];
-			joins[idx] = (idist * isize + jdist * jsize) / (isize + jsize);
-			//joins[idx] = (idist + jdist )/ 2;
-		}
-		//update the distance to the new node
-		miniPtr->node = nodeIdx;
-		mini = miniPtr->n;
-		for (jvalid = headValidNodes->next; jvalid != NULL;
-				jvalid = jvalid->next) {
-			minj = jvalid->n;
+/////////////////////////////////////////////////////////////////
+// findNeighbour()
+//
+// Returns the valid cluster closest to cluster n among those of
+// lower index, taking the lowest index on ties, and sets minDist to
+// its distance.  Returns -1, with minDist 1.1, if none is closer
+// than 1.1.  validNodes lists the valid clusters in increasing
+// order.
+/////////////////////////////////////////////////////////////////
 
-			float dist = joins[minj];
-			(*distMatrix)[mini][minj] = dist;
-			(*distMatrix)[minj][mini] = dist;
+static int findNeighbour(DistanceMatrix &distMatrix, const VI &validNodes,
+		int n, float &minDist) {
+	int neighbour = -1;
+	minDist = 1.1f;
+	for (int v = 0; v < (int) validNodes.size() && validNodes[v] < n; v++) {
+		float dist = getClusterDistance(distMatrix, n, validNodes[v]);
+		if (dist < minDist) {
+			minDist = dist;
+			neighbour = validNodes[v];
 		}
 	}
-	//add a pseudo root to this unrooted NJ tree
-	this->root = &nodes[lastNode - 1];
+	return neighbour;
+}
 
-	delete[] validNodes;
-	delete[] joins;
-	delete[] clusterLeafs;
+void MSAClusterTree::generateClusterTree() {
+	this->joinClusters(true);
 }
 
 //new add
 void MSAClusterTree::generateClusterTree(int varianceid) {
-	int i;
-	ValidNode* validNodes, *headValidNodes;
-	ValidNode* miniPtr, *minjPtr, *ivalid, *jvalid;
-	int mini, minj;
-	float* joins;
-	unsigned int* clusterLeafs;
+	this->joinClusters(varianceid != 0);
+}
 
-	//initialize the valid nodes link list
-	validNodes = new ValidNode[leafsNum + 1];
-	joins = new float[leafsNum + 1];
-	clusterLeafs = new unsigned int[nodesNum + 1];
-	if (!validNodes || !joins || !clusterLeafs) {
-		cerr << "Out of memory of the reconstruction of cluster tree" << endl;
+void MSAClusterTree::joinClusters(bool sizeWeighted) {
+	DistanceMatrix &distances = *distMatrix;
+
+	VI validNodes(leafsNum);	//the valid clusters in increasing order
+	VI clusterNodes(leafsNum);	//the tree node of each cluster
+	VI neighbours(leafsNum);	//the nearest neighbour of each cluster
+	VF neighbourDists(leafsNum);	//the distance to the nearest neighbour
+	VF joins(leafsNum);
+	SafeVector<unsigned int> clusterLeafs(nodesNum + 1);
+
+	//initialize cluster size and nearest neighbours
+	for (int n = 0; n < leafsNum; n++) {
+		validNodes[n] = n;
+		clusterNodes[n] = n;
+		clusterLeafs[n] = 1;
 	}
-	//initialize cluster size 
-	for (i = 0; i < this->leafsNum; i++) {
-		clusterLeafs[i] = 1;
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic, 64) if (leafsNum >= PARALLEL_JOIN_CLUSTERS)
+#endif
+	for (int n = 0; n < leafsNum; n++) {
+		neighbours[n] = findNeighbour(distances, validNodes, n,
+				neighbourDists[n]);
 	}
 
-	headValidNodes = &validNodes[0];
-	headValidNodes->next = &validNodes[1];
-	headValidNodes->n = -1;
-	headValidNodes->node = -1;
-	headValidNodes->prev = NULL;
-
-	//build an initial link list
-	ValidNode* curr = &validNodes[1];
-	ValidNode* prev = headValidNodes;
-	ValidNode* next = &validNodes[2];
-	for (i = 0; i < leafsNum; i++) {
-		curr->n = i;
-		curr->node = i;
-		curr->prev = prev;
-		curr->next = next;
-		prev = curr;
-		curr = next;
-		next++;
-	}
-	prev->next = NULL;
-
 	//to generate the cluster tree
 	int nodeIdx;	//the index of an internal node
 	int firstNode = leafsNum;	//the index of the first internal node
@@ -215,81 +141,72 @@ void MSAClusterTree::generateClusterTree(int varianceid) {
 	for (nodeIdx = firstNode; nodeIdx < lastNode; nodeIdx++) {
 		//find closest pair of clusters
 		float minDist = 1.1f;
-		miniPtr = headValidNodes;
-		minjPtr = headValidNodes;
-
-		for (ivalid = headValidNodes->next; ivalid != NULL;
-				ivalid = ivalid->next) {
-			mini = ivalid->n;
-			
-			for (jvalid = headValidNodes->next;
-					jvalid != NULL && jvalid->n < mini; jvalid = jvalid->next) {
-				minj = jvalid->n;
-				float dist = (*distMatrix)[mini][minj];
-				if (dist < 0) {
-					cerr
-							<< "ERROR: It is impossible to have distance value less than zero"
-							<< endl;
-					dist = 0;
-				}
-				if (dist < minDist) {
-					minDist = dist;
-					miniPtr = ivalid;
-					minjPtr = jvalid;
-				}
-				//printf("dist %g mini %d minj %d\n", dist, ivalid->node, jvalid->node);
+		int mini = -1;
+		for (int v = 0; v < (int) validNodes.size(); v++) {
+			int n = validNodes[v];
+			if (neighbourDists[n] < minDist) {
+				minDist = neighbourDists[n];
+				mini = n;
 			}
 		}
-		//printf("**** mini %d minj %d minDist %g *****\n", miniPtr->node, minjPtr->node, minDist);
-		//check the validity of miniPtr and minjPtr;
-		if (miniPtr == headValidNodes || minjPtr == headValidNodes) {
+		//check the validity of mini and minj;
+		if (mini < 0) {
 			cerr << "OOPS: Error occurred while constructing the cluster tree\n"
 					<< endl;
 			exit(-1);
 		}
+		int minj = neighbours[mini];
+
 		//computing branch length and join the two nodes
 		float branchLength = minDist * 0.5f;
-		this->connectNodes(&nodes[nodeIdx], nodeIdx, &nodes[miniPtr->node],
-				branchLength, &nodes[minjPtr->node], branchLength);
-		clusterLeafs[nodeIdx] = clusterLeafs[miniPtr->node]
-				+ clusterLeafs[minjPtr->node];
-
-		//remove the valid node minjPtr from the list
-		minjPtr->prev->next = minjPtr->next;
-		if (minjPtr->next != NULL) {
-			minjPtr->next->prev = minjPtr->prev;
-		}
-		minjPtr->prev = minjPtr->next = NULL;
-
-		//compute the distance of each remaining valid node to the new node
-		for (ivalid = headValidNodes->next; ivalid != NULL;
-				ivalid = ivalid->next) {
-			int idx = ivalid->n;
-
-			float idist = (*distMatrix)[miniPtr->n][idx];
-			float jdist = (*distMatrix)[minjPtr->n][idx];
-
-			unsigned int isize = clusterLeafs[miniPtr->node];
-			unsigned int jsize = clusterLeafs[minjPtr->node];
-			if(varianceid==0) joins[idx] = (idist + jdist )/ 2;
-			else joins[idx] = (idist * isize + jdist * jsize) / (isize + jsize);
+		this->connectNodes(&nodes[nodeIdx], nodeIdx, &nodes[clusterNodes[mini]],
+				branchLength, &nodes[clusterNodes[minj]], branchLength);
+		unsigned int isize = clusterLeafs[clusterNodes[mini]];
+		unsigned int jsize = clusterLeafs[clusterNodes[minj]];
+		clusterLeafs[nodeIdx] = isize + jsize;
+		clusterNodes[mini] = nodeIdx;
+
+		//remove the cluster minj
+		validNodes.erase(find(validNodes.begin(), validNodes.end(), minj));
+		const int numValid = validNodes.size();
+
+		//compute the distance of each remaining valid cluster to the new one
+#ifdef _OPENMP
+#pragma omp parallel for if (numValid >= PARALLEL_JOIN_CLUSTERS)
+#endif
+		for (int v = 0; v < numValid; v++) {
+			int idx = validNodes[v];
+			float idist = distances(mini, idx);
+			float jdist = distances(minj, idx);
+			if (sizeWeighted)
+				joins[idx] = (idist * isize + jdist * jsize) / (isize + jsize);
+			else
+				joins[idx] = (idist + jdist) / 2;
+			distances(mini, idx) = joins[idx];
 		}
-		//update the distance to the new node
-		miniPtr->node = nodeIdx;
-		mini = miniPtr->n;
-		for (jvalid = headValidNodes->next; jvalid != NULL;
-				jvalid = jvalid->next) {
-			minj = jvalid->n;
 
-			float dist = joins[minj];
-			(*distMatrix)[mini][minj] = dist;
-			(*distMatrix)[minj][mini] = dist;
+		//update the nearest neighbours; only clusters above minj can
+		//have had mini or minj as a neighbour or be closer to mini now
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic, 64) if (numValid >= PARALLEL_JOIN_CLUSTERS)
+#endif
+		for (int v = 0; v < numValid; v++) {
+			int n = validNodes[v];
+			if (n < minj)
+				continue;
+			if (n == mini || neighbours[n] == mini || neighbours[n] == minj) {
+				neighbours[n] = findNeighbour(distances, validNodes, n,
+						neighbourDists[n]);
+			} else if (n > mini) {
+				float dist = getClusterDistance(distances, n, mini);
+				if (dist < neighbourDists[n]
+						|| (dist == neighbourDists[n] && mini < neighbours[n])) {
+					neighbours[n] = mini;
+					neighbourDists[n] = dist;
+				}
+			}
 		}
 	}
-	//add a pseudo root to this unrooted NJ tree
+	//the last join is the root of the tree
 	this->root = &nodes[lastNode - 1];
-
-	delete[] validNodes;
-	delete[] joins;
-	delete[] clusterLeafs;
-}
\ No newline at end of file
+}
@@ -5,7 +5,7 @@
 
 class MSAClusterTree: public MSAGuideTree {
 public:
-	MSAClusterTree(MSA* msa, VVF& distMatrix, int numSeqs);
+	MSAClusterTree(MSA* msa, DistanceMatrix& distMatrix, int numSeqs);
 	~MSAClusterTree();
 
 	//construct the cluster tree
@@ -15,5 +15,8 @@ private:
 	//generate the cluster tree
 	void generateClusterTree();
 	void generateClusterTree(int);
+	//join the closest clusters by average linkage, weighting
+	//the joined clusters by their sizes or not
+	void joinClusters(bool sizeWeighted);
 };
 #endif
@@ -0,0 +1,274 @@
+/////////////////////////////////////////////////////////////////
+// MSAEmbedTree.cpp
+//
+// Routines for embedding guide tree (mBed)
+//
+// Every sequence is embedded as the vector of its distances to
+// about log2(N)^2 seed sequences, chosen by farthest-point
+// traversal, so only N times that many distances are read.  The
+// sequences are then split recursively in two by 2-means in the
+// embedding space, and clusters of at most UPGMA_CLUSTER_SIZE
+// sequences are joined by UPGMA on their actual distances.  The
+// two halves of a split are joined at half the distance of their
+// most central sequences.
+/////////////////////////////////////////////////////////////////
+
+#include <algorithm>
+#include <cfloat>
+#include "MSAEmbedTree.h"
+
+//the largest cluster joined by UPGMA rather than split further
+const int UPGMA_CLUSTER_SIZE = 32;
+//the maximum number of 2-means iterations of a split
+const int KMEANS_ITERATIONS = 20;
+//the size of a cluster from which 2-means runs in parallel
+const int PARALLEL_KMEANS_SIZE = 4096;
+
+MSAEmbedTree::MSAEmbedTree(MSA* msa, DistanceMatrix& distMatrix,
+		int numSeqs) :
+		MSAGuideTree(msa, distMatrix, numSeqs), numSeeds(0), nextNode(0) {
+}
+
+MSAEmbedTree::~MSAEmbedTree() {
+}
+
+void MSAEmbedTree::create() {
+	//generate the embedding tree
+	this->generateEmbedTree();
+
+	//calculate sequence weights
+	this->getSeqsWeights();
+
+	//construct the alignment orders
+	this->createAlignmentOrders();
+}
+
+void MSAEmbedTree::create(int varianceid) {
+	this->create();
+}
+
+void MSAEmbedTree::generateEmbedTree() {
+	this->embedSequences();
+
+	VI members(leafsNum);
+	for (int i = 0; i < leafsNum; i++) {
+		members[i] = i;
+	}
+	nextNode = leafsNum;
+	this->root = &nodes[this->buildSubtree(members)];
+	VF().swap(coords);
+}
+
+void MSAEmbedTree::embedSequences() {
+	DistanceMatrix& distances = *distMatrix;
+	double logSize = log((double) leafsNum) / log(2.0);
+	int maxSeeds = min(leafsNum, max(1, (int) ceil(logSize * logSize)));
+
+	//choose each seed as the sequence farthest from the previous ones
+	VI seeds;
+	VF minDists(leafsNum, FLT_MAX);
+	int seed = 0;
+	while ((int) seeds.size() < maxSeeds) {
+		seeds.push_back(seed);
+		float farthest = 0;
+		for (int i = 0; i < leafsNum; i++) {
+			minDists[i] = min(minDists[i], distances(i, seed));
+			if (minDists[i] > farthest) {
+				farthest = minDists[i];
+				seed = i;
+			}
+		}
+		//all sequences are identical to some seed
+		if (farthest == 0) {
+			break;
+		}
+	}
+
+	numSeeds = seeds.size();
+	coords.resize((size_t) leafsNum * numSeeds);
+	for (int i = 0; i < leafsNum; i++) {
+		for (int s = 0; s < numSeeds; s++) {
+			coords[(size_t) i * numSeeds + s] = distances(i, seeds[s]);
+		}
+	}
+}
+
+int MSAEmbedTree::buildSubtree(VI& members) {
+	if (members.size() == 1) {
+		return members[0];
+	}
+	if ((int) members.size() <= UPGMA_CLUSTER_SIZE) {
+		return this->joinCluster(members);
+	}
+
+	VI left, right;
+	if (!this->bisectCluster(members, left, right)) {
+		//the embedded sequences coincide; split them in halves
+		left.assign(members.begin(), members.begin() + members.size() / 2);
+		right.assign(members.begin() + members.size() / 2, members.end());
+	}
+	float branchLength = (*distMatrix)(this->findCentre(left),
+			this->findCentre(right)) * 0.5f;
+	VI().swap(members);
+
+	int leftNode = this->buildSubtree(left);
+	int rightNode = this->buildSubtree(right);
+	int nodeIdx = nextNode++;
+	this->connectNodes(&nodes[nodeIdx], nodeIdx, &nodes[leftNode],
+			branchLength, &nodes[rightNode], branchLength);
+	return nodeIdx;
+}
+
+//squared Euclidean distance of two points of the embedding
+static float squaredDistance(const float* x, const float* y, int dims) {
+	float dist = 0;
+	for (int d = 0; d < dims; d++) {
+		dist += (x[d] - y[d]) * (x[d] - y[d]);
+	}
+	return dist;
+}
+
+//the point among members farthest from a given point
+static int findFarthest(const VF& coords, int dims, const VI& members,
+		const float* point) {
+	int farthest = members[0];
+	float maxDist = -1;
+	for (int m = 0; m < (int) members.size(); m++) {
+		float dist = squaredDistance(&coords[(size_t) members[m] * dims], point,
+				dims);
+		if (dist > maxDist) {
+			maxDist = dist;
+			farthest = members[m];
+		}
+	}
+	return farthest;
+}
+
+//the centroid of members
+static void computeCentroid(const VF& coords, int dims, const VI& members,
+		VF& centroid) {
+	SafeVector<double> sums(dims, 0);
+	for (int m = 0; m < (int) members.size(); m++) {
+		const float* x = &coords[(size_t) members[m] * dims];
+		for (int d = 0; d < dims; d++) {
+			sums[d] += x[d];
+		}
+	}
+	centroid.resize(dims);
+	for (int d = 0; d < dims; d++) {
+		centroid[d] = sums[d] / members.size();
+	}
+}
+
+bool MSAEmbedTree::bisectCluster(const VI& members, VI& left, VI& right) {
+	const int numMembers = members.size();
+
+	//start from a point far out and the point farthest from it
+	VF leftCentre, rightCentre;
+	computeCentroid(coords, numSeeds, members, leftCentre);
+	int first = findFarthest(coords, numSeeds, members, &leftCentre[0]);
+	int second = findFarthest(coords, numSeeds, members,
+			&coords[(size_t) first * numSeeds]);
+	if (squaredDistance(&coords[(size_t) first * numSeeds],
+			&coords[(size_t) second * numSeeds], numSeeds) == 0) {
+		return false;
+	}
+	leftCentre.assign(coords.begin() + (size_t) first * numSeeds,
+			coords.begin() + (size_t) (first + 1) * numSeeds);
+	rightCentre.assign(coords.begin() + (size_t) second * numSeeds,
+			coords.begin() + (size_t) (second + 1) * numSeeds);
+
+	//assign every point to the closer centre until nothing changes
+	VI sides(numMembers, -1);
+	for (int iter = 0; iter < KMEANS_ITERATIONS; iter++) {
+		int changed = 0;
+#ifdef _OPENMP
+#pragma omp parallel for reduction(+:changed) if (numMembers >= PARALLEL_KMEANS_SIZE)
+#endif
+		for (int m = 0; m < numMembers; m++) {
+			const float* x = &coords[(size_t) members[m] * numSeeds];
+			int side = squaredDistance(x, &rightCentre[0], numSeeds)
+					< squaredDistance(x, &leftCentre[0], numSeeds);
+			if (side != sides[m]) {
+				sides[m] = side;
+				changed++;
+			}
+		}
+		left.clear();
+		right.clear();
+		for (int m = 0; m < numMembers; m++) {
+			(sides[m] ? right : left).push_back(members[m]);
+		}
+		if (changed == 0 || left.empty() || right.empty()) {
+			break;
+		}
+		computeCentroid(coords, numSeeds, left, leftCentre);
+		computeCentroid(coords, numSeeds, right, rightCentre);
+	}
+	return !left.empty() && !right.empty();
+}
+
+int MSAEmbedTree::findCentre(const VI& members) {
+	VF centroid;
+	computeCentroid(coords, numSeeds, members, centroid);
+	int centre = members[0];
+	float minDist = FLT_MAX;
+	for (int m = 0; m < (int) members.size(); m++) {
+		float dist = squaredDistance(&coords[(size_t) members[m] * numSeeds],
+				&centroid[0], numSeeds);
+		if (dist < minDist) {
+			minDist = dist;
+			centre = members[m];
+		}
+	}
+	return centre;
+}
+
+int MSAEmbedTree::joinCluster(const VI& members) {
+	const int numMembers = members.size();
+	VVF dists(numMembers, VF(numMembers, 0));
+	for (int i = 0; i < numMembers; i++) {
+		for (int j = 0; j < i; j++) {
+			dists[i][j] = dists[j][i] = (*distMatrix)(members[i], members[j]);
+		}
+	}
+	VI clusterNodes(members);	//the tree node of each cluster
+	VI clusterLeafs(numMembers, 1);	//the size of each cluster
+	VI valid(numMembers, 1);	//whether each cluster is still valid
+
+	for (int numValid = numMembers; numValid > 1; numValid--) {
+		//find closest pair of clusters
+		float minDist = FLT_MAX;
+		int mini = -1, minj = -1;
+		for (int i = 0; i < numMembers; i++) {
+			for (int j = 0; valid[i] && j < i; j++) {
+				if (valid[j] && dists[i][j] < minDist) {
+					minDist = dists[i][j];
+					mini = i;
+					minj = j;
+				}
+			}
+		}
+
+		//computing branch length and join the two nodes
+		int nodeIdx = nextNode++;
+		float branchLength = max(minDist, 0.0f) * 0.5f;
+		this->connectNodes(&nodes[nodeIdx], nodeIdx, &nodes[clusterNodes[mini]],
+				branchLength, &nodes[clusterNodes[minj]], branchLength);
+
+		//compute the distance of each remaining cluster to the new one
+		int isize = clusterLeafs[mini];
+		int jsize = clusterLeafs[minj];
+		for (int k = 0; k < numMembers; k++) {
+			if (valid[k] && k != mini && k != minj) {
+				dists[mini][k] = dists[k][mini] = (dists[mini][k] * isize
+						+ dists[minj][k] * jsize) / (isize + jsize);
+			}
+		}
+		clusterNodes[mini] = nodeIdx;
+		clusterLeafs[mini] = isize + jsize;
+		valid[minj] = 0;
+	}
+	//the last join is the root of the cluster
+	return nextNode - 1;
+}
@@ -0,0 +1,32 @@
+#ifndef _MSA_EMBED_TREE_H
+#define _MSA_EMBED_TREE_H
+
+#include "MSAGuideTree.h"
+
+class MSAEmbedTree: public MSAGuideTree {
+public:
+	MSAEmbedTree(MSA* msa, DistanceMatrix& distMatrix, int numSeqs);
+	~MSAEmbedTree();
+
+	//construct the embedding tree
+	void create();
+	void create(int);
+private:
+	//generate the embedding tree
+	void generateEmbedTree();
+	//embed the sequences by their distances to a set of seeds
+	void embedSequences();
+	//build the subtree of a cluster of sequences; returns its root
+	int buildSubtree(VI& members);
+	//split a cluster in two by 2-means; returns false if it cannot
+	bool bisectCluster(const VI& members, VI& left, VI& right);
+	//join a small cluster by UPGMA on the sequence distances
+	int joinCluster(const VI& members);
+	//find the member of a cluster closest to its centroid
+	int findCentre(const VI& members);
+
+	int numSeeds;	//the number of dimensions of the embedding
+	VF coords;	//the coordinates of every sequence
+	int nextNode;	//the index of the next internal node
+};
+#endif
@@ -4,9 +4,11 @@
 // Utilities for tree data structure
 /////////////////////////////////////////////////////////////////
 
+#include <algorithm>
+#include <set>
 #include "MSAGuideTree.h"
 #include "MSA.h"
-MSAGuideTree::MSAGuideTree(MSA* msa, VVF& distances, int numSeqs) {
+MSAGuideTree::MSAGuideTree(MSA* msa, DistanceMatrix& distances, int numSeqs) {
 	int i;
 	TreeNode* node;
 	//system configuration
@@ -318,6 +320,235 @@ void MSAGuideTree::getSeqsWeights() {
 		//printf("%d \n", seqsWeights[i]);
 	}
 }
+/*********************************
+ write the tree in Newick format
+ *********************************/
+void MSAGuideTree::writeNewick(ostream& out, MultiSequence* sequences) {
+	int precision = out.precision(9);
+	recursiveWriteNewick(out, this->root, sequences);
+	out << ";" << endl;
+	out.precision(precision);
+}
+void MSAGuideTree::recursiveWriteNewick(ostream& out, TreeNode* subRoot,
+		MultiSequence* sequences) {
+	if (subRoot->leaf == LEAF) {
+		//quote names with characters that are special in Newick
+		string name = sequences->GetSequence(subRoot->idx)->GetName();
+		if (name.find_first_of("()[]':;, \t") == string::npos) {
+			out << name;
+		} else {
+			out << "'";
+			for (int i = 0; i < (int) name.length(); i++) {
+				out << (name[i] == '\'' ? "''" : string(1, name[i]));
+			}
+			out << "'";
+		}
+	} else {
+		out << "(";
+		recursiveWriteNewick(out, subRoot->left, sequences);
+		out << ",";
+		recursiveWriteNewick(out, subRoot->right, sequences);
+		out << ")";
+	}
+	if (subRoot != this->root) {
+		out << ":" << subRoot->dist;
+	}
+}
+/*********************************
+ rebalance the tree
+ *********************************/
+void MSAGuideTree::rebalance(float tolerance) {
+	if (leafsNum < 3) {
+		return;
+	}
+	int oldDepth = getDepth();
+
+	//move the root to the centroid, so that both halves are aligned
+	//independently of each other
+	rerootAtCentroid();
+
+	//merge the chains of joins closer than the tolerance
+	VI numLeafs(nodesNum, 0);
+	recursiveCountLeafs(this->root, numLeafs);
+	balanceChains(this->root, tolerance * recursiveGetHeight(this->root),
+			numLeafs);
+
+	//the alignment orders follow the new tree; the sequence weights
+	//are left as computed from the original one
+	releaseAlignmentOrders();
+	this->alignOrders = 0;
+	createAlignmentOrders();
+
+	cerr << "[Main] Rebalanced guide tree: critical path of " << oldDepth
+			<< " -> " << getDepth() << " profile alignments" << endl;
+}
+int MSAGuideTree::getDepth() {
+	return recursiveGetDepth(this->root);
+}
+void MSAGuideTree::rerootAtCentroid() {
+	VI numLeafs(nodesNum, 0);
+	recursiveCountLeafs(this->root, numLeafs);
+
+	//the two branches below the root form one branch of the unrooted
+	//tree; look for a branch splitting the leafs more evenly
+	TreeNode* left = this->root->left;
+	TreeNode* right = this->root->right;
+	int bestSize = max(numLeafs[left->idx], numLeafs[right->idx]);
+	TreeNode* best = 0;
+	for (int i = 0; i < nodesNum; i++) {
+		TreeNode* node = &nodes[i];
+		if (node == this->root || node->parent == this->root) {
+			continue;
+		}
+		int size = max(numLeafs[i], leafsNum - numLeafs[i]);
+		if (size < bestSize) {
+			bestSize = size;
+			best = node;
+		}
+	}
+	if (!best) {
+		return;
+	}
+
+	//the neighbours of each node in the unrooted tree
+	SafeVector<SafeVector<pair<int, float> > > neighbours(nodesNum);
+	for (int i = 0; i < nodesNum; i++) {
+		TreeNode* node = &nodes[i];
+		if (node == this->root) {
+			continue;
+		}
+		if (node->leaf == NODE) {
+			neighbours[i].push_back(make_pair(node->leftIdx, node->left->dist));
+			neighbours[i].push_back(
+					make_pair(node->rightIdx, node->right->dist));
+		}
+		if (node->parent == this->root) {
+			TreeNode* sibling = (node == left) ? right : left;
+			neighbours[i].push_back(
+					make_pair(sibling->idx, node->dist + sibling->dist));
+		} else {
+			neighbours[i].push_back(make_pair(node->parentIdx, node->dist));
+		}
+	}
+
+	//hang the tree from the middle of the branch above the centroid
+	TreeNode* parent = best->parent;
+	float dist = best->dist;
+	orientSubtree(best, parent, neighbours);
+	orientSubtree(parent, best, neighbours);
+	connectNodes(this->root, this->root->idx, best, dist / 2, parent,
+			dist / 2);
+}
+void MSAGuideTree::orientSubtree(TreeNode* subRoot, TreeNode* from,
+		const SafeVector<SafeVector<pair<int, float> > >& neighbours) {
+	if (subRoot->leaf == LEAF) {
+		return;
+	}
+	TreeNode* children[2];
+	float dists[2];
+	int childrenNum = 0;
+	const SafeVector<pair<int, float> >& edges = neighbours[subRoot->idx];
+	for (int i = 0; i < (int) edges.size(); i++) {
+		if (edges[i].first != from->idx) {
+			assert(childrenNum < 2);
+			children[childrenNum] = &nodes[edges[i].first];
+			dists[childrenNum++] = edges[i].second;
+		}
+	}
+	assert(childrenNum == 2);
+	orientSubtree(children[0], subRoot, neighbours);
+	orientSubtree(children[1], subRoot, neighbours);
+	connectNodes(subRoot, subRoot->idx, children[0], dists[0], children[1],
+			dists[1]);
+}
+void MSAGuideTree::balanceChains(TreeNode* subRoot, float threshold,
+		VI& numLeafs) {
+	if (subRoot->leaf == LEAF) {
+		return;
+	}
+	//the subtrees hanging from the chain, their distances to the
+	//subtree root, and the internal nodes of the chain
+	SafeVector<TreeNode*> members;
+	SafeVector<float> dists;
+	SafeVector<TreeNode*> joins;
+	collectChain(subRoot->left, subRoot->left->dist, threshold, members,
+			dists, joins);
+	collectChain(subRoot->right, subRoot->right->dist, threshold, members,
+			dists, joins);
+	const int membersNum = members.size();
+
+	if (membersNum > 2) {
+		//rejoin the subtrees, always joining the two with the fewest
+		//leafs, reusing the nodes of the chain; the distance of each
+		//leaf to the subtree root is kept
+		set<pair<int, int> > queue;
+		for (int i = 0; i < (int) members.size(); i++) {
+			queue.insert(make_pair(numLeafs[members[i]->idx], i));
+		}
+		while (queue.size() > 2) {
+			int first = queue.begin()->second;
+			queue.erase(queue.begin());
+			int second = queue.begin()->second;
+			queue.erase(queue.begin());
+
+			TreeNode* join = joins.back();
+			joins.pop_back();
+			connectNodes(join, join->idx, members[first], dists[first],
+					members[second], dists[second]);
+			numLeafs[join->idx] = numLeafs[members[first]->idx]
+					+ numLeafs[members[second]->idx];
+			queue.insert(make_pair(numLeafs[join->idx], (int) members.size()));
+			members.push_back(join);
+			dists.push_back(0);
+		}
+		int first = queue.begin()->second;
+		int second = (++queue.begin())->second;
+		connectNodes(subRoot, subRoot->idx, members[first], dists[first],
+				members[second], dists[second]);
+	}
+
+	//continue below the chain
+	for (int i = 0; i < membersNum; i++) {
+		balanceChains(members[i], threshold, numLeafs);
+	}
+}
+void MSAGuideTree::collectChain(TreeNode* subRoot, float dist,
+		float threshold, SafeVector<TreeNode*>& members,
+		SafeVector<float>& dists, SafeVector<TreeNode*>& joins) {
+	if (subRoot->leaf == NODE && subRoot->dist <= threshold) {
+		joins.push_back(subRoot);
+		collectChain(subRoot->left, dist + subRoot->left->dist, threshold,
+				members, dists, joins);
+		collectChain(subRoot->right, dist + subRoot->right->dist, threshold,
+				members, dists, joins);
+	} else {
+		members.push_back(subRoot);
+		dists.push_back(dist);
+	}
+}
+int MSAGuideTree::recursiveCountLeafs(TreeNode* subRoot, VI& numLeafs) {
+	int count = 1;
+	if (subRoot->leaf == NODE) {
+		count = recursiveCountLeafs(subRoot->left, numLeafs)
+				+ recursiveCountLeafs(subRoot->right, numLeafs);
+	}
+	numLeafs[subRoot->idx] = count;
+	return count;
+}
+int MSAGuideTree::recursiveGetDepth(TreeNode* subRoot) {
+	if (subRoot->leaf == LEAF) {
+		return 0;
+	}
+	return 1 + max(recursiveGetDepth(subRoot->left),
+			recursiveGetDepth(subRoot->right));
+}
+float MSAGuideTree::recursiveGetHeight(TreeNode* subRoot) {
+	if (subRoot->leaf == LEAF) {
+		return 0;
+	}
+	return max(subRoot->left->dist + recursiveGetHeight(subRoot->left),
+			subRoot->right->dist + recursiveGetHeight(subRoot->right));
+}
 void MSAGuideTree::create() {
 	//do nothing
 }
@@ -8,6 +8,7 @@
 #include "ScoreType.h"
 #include "ProbabilisticModel.h"
 #include "SparseMatrix.h"
+#include "DistanceMatrix.h"
 
 class MSA;
 struct ValidNode {
@@ -42,7 +43,7 @@ struct AlignmentOrder {
 
 class MSAGuideTree {
 public:
-	MSAGuideTree(MSA* msa, VVF& distMatrix, int numSeqs);
+	MSAGuideTree(MSA* msa, DistanceMatrix& distMatrix, int numSeqs);
 	virtual ~MSAGuideTree() = 0;	//abstract class
 
 	//get the tree nodes
@@ -70,6 +71,15 @@ public:
 	//calculate the sequence weights
 	virtual void getSeqsWeights();
 
+	//write the tree in Newick format, naming the leafs by sequences
+	void writeNewick(ostream& out, MultiSequence* sequences);
+
+	//re-root the tree at its centroid and balance the chains of joins
+	//with branches shorter than the tolerance times the tree height
+	void rebalance(float tolerance);
+	//get the largest number of joins from the root to a leaf
+	int getDepth();
+
 	/**********DEBUGING****************/
 	//display the tree
 	void displayTree();
@@ -85,10 +95,29 @@ protected:
 	//recursive implemenation of constructing the alignment orders
 	int recursiveCreateAlignmentOrders(TreeNode* subRoot, int* subLeafs,
 			int& subLeafsNum, int nodeDepth);
+	//recursive implementation of writing the tree in Newick format
+	void recursiveWriteNewick(ostream& out, TreeNode* subRoot,
+			MultiSequence* sequences);
+	//move the root to the branch that splits the leafs most evenly
+	void rerootAtCentroid();
+	//join the nodes below a subtree root away from the given neighbour
+	void orientSubtree(TreeNode* subRoot, TreeNode* from,
+			const SafeVector<SafeVector<pair<int, float> > >& neighbours);
+	//replace the chains of short branches below a subtree root by
+	//balanced subtrees
+	void balanceChains(TreeNode* subRoot, float threshold, VI& numLeafs);
+	//collect the subtrees hanging from a chain of short branches
+	void collectChain(TreeNode* subRoot, float dist, float threshold,
+			SafeVector<TreeNode*>& members, SafeVector<float>& dists,
+			SafeVector<TreeNode*>& joins);
+	//recursive implementations of measuring the tree
+	int recursiveCountLeafs(TreeNode* subRoot, VI& numLeafs);
+	int recursiveGetDepth(TreeNode* subRoot);
+	float recursiveGetHeight(TreeNode* subRoot);
 
 	//system configurations
 	MSA* msa;
-	VVF* distMatrix;
+	DistanceMatrix* distMatrix;
 	int numSeqs;
 	int* seqsWeights;
 
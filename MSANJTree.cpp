@@ -0,0 +1,244 @@
+/////////////////////////////////////////////////////////////////
+// MSANJTree.cpp
+//
+// Routines for neighbor-joining guide tree
+//
+// The pair to join is the one minimizing
+//
+//   Q(a,b) = (r - 2) D(a,b) - u(a) - u(b)
+//
+// where r is the number of valid clusters and u(a) the sum of the
+// distances of cluster a to all others.  As in RapidNJ, every
+// cluster keeps a row of its distances to other clusters, sorted in
+// increasing order.  Scanning the sorted row of a,
+// Q(a,b) >= (r - 2) D(a,b) - u(a) - max u, so the scan stops as
+// soon as that bound exceeds the best Q found so far, and usually
+// only the first few entries of each row are read.  A row therefore
+// holds only the ROW_ENTRIES closest clusters; when a scan gets
+// past all of them the row is refilled from the distance matrix,
+// and if that does not suffice either the matrix row is scanned in
+// full.  Entries of clusters joined since the row was filled are
+// skipped; a pair with a newer cluster is found in the row of the
+// newer one.
+/////////////////////////////////////////////////////////////////
+
+#include <algorithm>
+#include "MSANJTree.h"
+
+//the number of closest clusters kept in a sorted row
+const int ROW_ENTRIES = 128;
+
+MSANJTree::MSANJTree(MSA* msa, DistanceMatrix& distMatrix,
+		int numSeqs) :
+		MSAGuideTree(msa, distMatrix, numSeqs) {
+}
+
+MSANJTree::~MSANJTree() {
+}
+
+void MSANJTree::create() {
+	//generate the neighbor-joining tree
+	this->generateNJTree();
+
+	//calculate sequence weights
+	this->getSeqsWeights();
+
+	//construct the alignment orders
+	this->createAlignmentOrders();
+}
+
+void MSANJTree::create(int varianceid) {
+	this->create();
+}
+
+//order row entries by distance, then by tree node
+static bool compareEntries(const NJEntry& a, const NJEntry& b) {
+	return a.dist < b.dist || (a.dist == b.dist && a.node < b.node);
+}
+
+bool MSANJTree::fillRow(int slot, const VI& validSlots, const VI& slotNodes,
+		SafeVector<NJEntry>& scratch, SafeVector<NJEntry>& row) {
+	scratch.clear();
+	for (int v = 0; v < (int) validSlots.size(); v++) {
+		int k = validSlots[v];
+		if (k == slot) {
+			continue;
+		}
+		NJEntry entry;
+		entry.dist = (*distMatrix)(slot, k);
+		entry.node = slotNodes[k];
+		scratch.push_back(entry);
+	}
+
+	//keep the closest clusters in order
+	bool truncated = scratch.size() > (size_t) ROW_ENTRIES;
+	if (truncated) {
+		nth_element(scratch.begin(), scratch.begin() + ROW_ENTRIES,
+				scratch.end(), compareEntries);
+		scratch.resize(ROW_ENTRIES);
+	}
+	sort(scratch.begin(), scratch.end(), compareEntries);
+	row.assign(scratch.begin(), scratch.end());
+	return truncated;
+}
+
+void MSANJTree::generateNJTree() {
+	DistanceMatrix& distances = *distMatrix;
+
+	//clusters are kept in the rows of the distance matrix (slots); a
+	//joined cluster takes the slot of one of its children
+	VI validSlots(leafsNum);	//the slots of the valid clusters
+	VI slotNodes(leafsNum);	//the tree node of the cluster in each slot
+	VI nodeSlots(nodesNum + 1, -1);	//the slot of each valid tree node
+	SafeVector<double> sums(leafsNum, 0);	//u of each slot
+	SafeVector<SafeVector<NJEntry> > rows(leafsNum);	//sorted rows
+	VI rowStarts(leafsNum, 0);	//the first entry of each row still valid
+	VI rowTruncated(leafsNum, 0);	//whether a row misses some clusters
+	SafeVector<NJEntry> scratch;
+
+	for (int i = 0; i < leafsNum; i++) {
+		validSlots[i] = i;
+		slotNodes[i] = i;
+		nodeSlots[i] = i;
+	}
+#ifdef _OPENMP
+#pragma omp parallel
+#endif
+	{
+		SafeVector<NJEntry> threadScratch;
+#ifdef _OPENMP
+#pragma omp for schedule(dynamic, 64)
+#endif
+		for (int i = 0; i < leafsNum; i++) {
+			for (int j = 0; j < leafsNum; j++) {
+				if (j != i) {
+					sums[i] += distances(i, j);
+				}
+			}
+			rowTruncated[i] = this->fillRow(i, validSlots, slotNodes,
+					threadScratch, rows[i]);
+		}
+	}
+
+	//to generate the neighbor-joining tree
+	int nodeIdx;	//the index of an internal node
+	int firstNode = leafsNum;	//the index of the first internal node
+	int lastNode = firstNode + leafsNum - 1;//the index of the last internal node
+
+	for (nodeIdx = firstNode; nodeIdx < lastNode - 1; nodeIdx++) {
+		const int numValid = validSlots.size();
+		const double scale = numValid - 2;
+		double maxSum = sums[validSlots[0]];
+		for (int v = 1; v < numValid; v++) {
+			maxSum = max(maxSum, sums[validSlots[v]]);
+		}
+
+		//find the pair minimizing Q, pruning each sorted row
+		double minQ = 0;
+		int mini = -1, minj = -1;
+		for (int v = 0; v < numValid; v++) {
+			int a = validSlots[v];
+			for (int pass = 0;; pass++) {
+				const SafeVector<NJEntry>& row = rows[a];
+
+				//skip the joined clusters at the front of the row for good
+				while (rowStarts[a] < (int) row.size()
+						&& nodeSlots[row[rowStarts[a]].node] < 0) {
+					rowStarts[a]++;
+				}
+				bool pruned = false;
+				for (int e = rowStarts[a]; e < (int) row.size(); e++) {
+					double bound = scale * row[e].dist - sums[a] - maxSum;
+					if (mini >= 0 && bound >= minQ) {
+						pruned = true;
+						break;
+					}
+					int b = nodeSlots[row[e].node];
+					if (b < 0) {
+						continue;
+					}
+					double q = scale * row[e].dist - sums[a] - sums[b];
+					if (mini < 0 || q < minQ) {
+						minQ = q;
+						mini = a;
+						minj = b;
+					}
+				}
+				if (pruned || !rowTruncated[a]) {
+					break;
+				}
+				if (pass == 0) {
+					//refill the row with the closest valid clusters
+					rowTruncated[a] = this->fillRow(a, validSlots, slotNodes,
+							scratch, rows[a]);
+					rowStarts[a] = 0;
+					continue;
+				}
+				//the row holds too few clusters to prune; scan all
+				for (int w = 0; w < numValid; w++) {
+					int b = validSlots[w];
+					if (b == a) {
+						continue;
+					}
+					double q = scale * distances(a, b) - sums[a] - sums[b];
+					if (q < minQ) {
+						minQ = q;
+						mini = a;
+						minj = b;
+					}
+				}
+				break;
+			}
+		}
+		if (mini < 0) {
+			cerr << "OOPS: Error occurred while constructing the NJ tree\n"
+					<< endl;
+			exit(-1);
+		}
+
+		//computing branch lengths and join the two nodes
+		float dist = distances(mini, minj);
+		float leftLength = (float) (dist * 0.5
+				+ (sums[mini] - sums[minj]) / (2 * scale));
+		float rightLength = dist - leftLength;
+		this->connectNodes(&nodes[nodeIdx], nodeIdx, &nodes[slotNodes[mini]],
+				max(leftLength, 0.0f), &nodes[slotNodes[minj]],
+				max(rightLength, 0.0f));
+
+		//the new cluster takes the slot mini and minj is removed
+		nodeSlots[slotNodes[mini]] = -1;
+		nodeSlots[slotNodes[minj]] = -1;
+		nodeSlots[nodeIdx] = mini;
+		slotNodes[mini] = nodeIdx;
+		validSlots.erase(find(validSlots.begin(), validSlots.end(), minj));
+		SafeVector<NJEntry>().swap(rows[minj]);
+
+		//compute the distance of each remaining cluster to the new one
+		double newSum = 0;
+		for (int v = 0; v < numValid - 1; v++) {
+			int k = validSlots[v];
+			if (k == mini) {
+				continue;
+			}
+			float kdist = (distances(mini, k) + distances(minj, k) - dist)
+					* 0.5f;
+			sums[k] += kdist - distances(mini, k) - distances(minj, k);
+			distances(mini, k) = kdist;
+			newSum += kdist;
+		}
+		sums[mini] = newSum;
+		rowTruncated[mini] = this->fillRow(mini, validSlots, slotNodes, scratch,
+				rows[mini]);
+		rowStarts[mini] = 0;
+	}
+
+	//join the last two clusters at the root
+	if (leafsNum > 1) {
+		int mini = validSlots[0];
+		int minj = validSlots[1];
+		float branchLength = max(distances(mini, minj) * 0.5f, 0.0f);
+		this->connectNodes(&nodes[nodeIdx], nodeIdx, &nodes[slotNodes[mini]],
+				branchLength, &nodes[slotNodes[minj]], branchLength);
+	}
+	this->root = &nodes[lastNode - 1];
+}
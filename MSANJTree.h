@@ -0,0 +1,28 @@
+#ifndef _MSA_NJ_TREE_H
+#define _MSA_NJ_TREE_H
+
+#include "MSAGuideTree.h"
+
+//an entry of a sorted row of the neighbor-joining distance matrix
+struct NJEntry {
+	float dist;			//the distance to the cluster
+	int node;			//the tree node of the cluster
+};
+
+class MSANJTree: public MSAGuideTree {
+public:
+	MSANJTree(MSA* msa, DistanceMatrix& distMatrix, int numSeqs);
+	~MSANJTree();
+
+	//construct the neighbor-joining tree
+	void create();
+	void create(int);
+private:
+	//generate the neighbor-joining tree
+	void generateNJTree();
+	//fill the sorted row of a cluster with the closest valid
+	//clusters; returns whether some had to be left out
+	bool fillRow(int slot, const VI& validSlots, const VI& slotNodes,
+			SafeVector<NJEntry>& scratch, SafeVector<NJEntry>& row);
+};
+#endif
@@ -0,0 +1,194 @@
+/////////////////////////////////////////////////////////////////
+// MSANewickTree.cpp
+//
+// Routines for guide tree read from a Newick file
+//
+// Leafs are matched to sequences by name, the first word of their
+// header.  Nodes with more than two children are resolved into a
+// left-leaning chain of binary nodes joined by zero-length
+// branches, and nodes with a single child are dropped.  Missing
+// branch lengths are taken as zero.  Internal nodes are numbered in
+// post-order, so that the root is the last node.
+/////////////////////////////////////////////////////////////////
+
+#include <fstream>
+#include <sstream>
+#include <cctype>
+#include "MSANewickTree.h"
+
+MSANewickTree::MSANewickTree(MSA* msa, DistanceMatrix& distMatrix,
+		int numSeqs, MultiSequence* sequences, const string& fileName) :
+		MSAGuideTree(msa, distMatrix, numSeqs), sequences(sequences), fileName(
+				fileName), pos(0), nextNode(0) {
+}
+
+MSANewickTree::~MSANewickTree() {
+}
+
+void MSANewickTree::create() {
+	//read the guide tree
+	this->readNewickTree();
+
+	//calculate sequence weights
+	this->getSeqsWeights();
+
+	//construct the alignment orders
+	this->createAlignmentOrders();
+}
+
+void MSANewickTree::create(int varianceid) {
+	this->create();
+}
+
+void MSANewickTree::failParse(const string& message) {
+	cerr << "ERROR: Guide tree file " << fileName << ": " << message << endl;
+	exit(1);
+}
+
+void MSANewickTree::readNewickTree() {
+	ifstream infile(fileName.c_str());
+	if (!infile) {
+		cerr << "ERROR: Could not open guide tree file " << fileName << endl;
+		exit(1);
+	}
+	stringstream contents;
+	contents << infile.rdbuf();
+	text = contents.str();
+
+	for (int i = 0; i < leafsNum; i++) {
+		string name = sequences->GetSequence(i)->GetName();
+		if (leafIndices.count(name)) {
+			failParse("sequence name " + name + " is not unique");
+		}
+		leafIndices[name] = i;
+	}
+	leafUsed.assign(leafsNum, 0);
+	nextNode = leafsNum;
+
+	pos = 0;
+	float length;
+	int rootNode = this->parseSubtree(length);
+	skipSpace();
+	if (pos >= text.length() || text[pos] != ';') {
+		failParse("';' expected at the end of the tree");
+	}
+	for (int i = 0; i < leafsNum; i++) {
+		if (!leafUsed[i]) {
+			failParse("sequence " + sequences->GetSequence(i)->GetName()
+					+ " is missing");
+		}
+	}
+	this->root = &nodes[rootNode];
+	text.clear();
+}
+
+void MSANewickTree::skipSpace() {
+	while (pos < text.length()) {
+		if (isspace(text[pos])) {
+			pos++;
+		} else if (text[pos] == '[') {
+			//comments run to the closing bracket
+			pos = text.find(']', pos);
+			if (pos == string::npos) {
+				failParse("unterminated comment");
+			}
+			pos++;
+		} else {
+			break;
+		}
+	}
+}
+
+string MSANewickTree::parseLabel() {
+	string label;
+	skipSpace();
+	if (pos < text.length() && text[pos] == '\'') {
+		//quoted labels escape quotes by doubling them
+		for (pos++;; pos++) {
+			if (pos >= text.length()) {
+				failParse("unterminated quoted label");
+			}
+			if (text[pos] == '\'') {
+				if (pos + 1 < text.length() && text[pos + 1] == '\'') {
+					pos++;
+				} else {
+					pos++;
+					break;
+				}
+			}
+			label += text[pos];
+		}
+	} else {
+		while (pos < text.length() && !isspace(text[pos])
+				&& string("()[]':;,").find(text[pos]) == string::npos) {
+			label += text[pos++];
+		}
+	}
+	return label;
+}
+
+int MSANewickTree::parseSubtree(float& length) {
+	int node;
+	skipSpace();
+	if (pos < text.length() && text[pos] == '(') {
+		//parse the children, joining them from the left
+		node = -1;
+		float nodeLength = 0;
+		do {
+			pos++;
+			float childLength;
+			int child = this->parseSubtree(childLength);
+			if (node < 0) {
+				node = child;
+				nodeLength = childLength;
+			} else {
+				int nodeIdx = nextNode++;
+				if (nodeIdx >= nodesNum) {
+					failParse("too many nodes");
+				}
+				this->connectNodes(&nodes[nodeIdx], nodeIdx, &nodes[node],
+						nodeLength, &nodes[child], childLength);
+				node = nodeIdx;
+				nodeLength = 0;
+			}
+			skipSpace();
+		} while (pos < text.length() && text[pos] == ',');
+		if (pos >= text.length() || text[pos] != ')') {
+			failParse("')' expected");
+		}
+		pos++;
+
+		//internal node labels are ignored
+		this->parseLabel();
+	} else {
+		string name = this->parseLabel();
+		if (name.length() == 0) {
+			failParse("sequence name expected");
+		}
+		map<string, int>::iterator leaf = leafIndices.find(name);
+		if (leaf == leafIndices.end()) {
+			failParse("unknown sequence " + name);
+		}
+		if (leafUsed[leaf->second]) {
+			failParse("sequence " + name + " appears twice");
+		}
+		leafUsed[leaf->second] = 1;
+		node = leaf->second;
+	}
+
+	//parse the branch length
+	length = 0;
+	skipSpace();
+	if (pos < text.length() && text[pos] == ':') {
+		pos++;
+		skipSpace();
+		const char* start = text.c_str() + pos;
+		char* end;
+		length = strtof(start, &end);
+		if (end == start) {
+			failParse("branch length expected");
+		}
+		pos += end - start;
+	}
+	return node;
+}
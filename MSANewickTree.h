@@ -0,0 +1,36 @@
+#ifndef _MSA_NEWICK_TREE_H
+#define _MSA_NEWICK_TREE_H
+
+#include <map>
+#include "MSAGuideTree.h"
+
+class MSANewickTree: public MSAGuideTree {
+public:
+	MSANewickTree(MSA* msa, DistanceMatrix& distMatrix, int numSeqs,
+			MultiSequence* sequences, const string& fileName);
+	~MSANewickTree();
+
+	//construct the tree read from the Newick file
+	void create();
+	void create(int);
+private:
+	//read the tree from the Newick file
+	void readNewickTree();
+	//parse a subtree at pos; returns its root and branch length
+	int parseSubtree(float& length);
+	//parse a possibly quoted label at pos
+	string parseLabel();
+	//skip white space and comments at pos
+	void skipSpace();
+	//report a malformed tree and exit
+	void failParse(const string& message);
+
+	MultiSequence* sequences;
+	string fileName;
+	string text;	//the contents of the Newick file
+	size_t pos;	//the parsing position in text
+	map<string, int> leafIndices;	//the leaf of each sequence name
+	VI leafUsed;	//whether each leaf has appeared in the tree
+	int nextNode;	//the index of the next internal node
+};
+#endif
@@ -28,6 +28,19 @@
 class MultiSequence {
 
 	SafeVector<Sequence *> *sequences;
+	mutable VI mappingStarts;         // first residue of each sequence
+	mutable VI mappingColumns;        // alignment column of each residue
+
+	/////////////////////////////////////////////////////////////////
+	// MultiSequence::ClearMappings()
+	//
+	// Drops the cached mappings after the sequences have changed.
+	/////////////////////////////////////////////////////////////////
+
+	void ClearMappings() {
+		mappingStarts.clear();
+		mappingColumns.clear();
+	}
 
 public:
 
@@ -265,6 +278,7 @@ public:
 	/////////////////////////////////////////////////////////////////
 
 	void LoadMFA(FileBuffer &infile, bool stripGaps = false) {
+		ClearMappings();
 
 		// check to make sure that file reading is ok
 		if (infile.fail()) {
@@ -321,6 +335,7 @@ public:
 	void AddSequence(Sequence *sequence) {
 		assert(sequence);
 		assert(!sequence->Fail());
+		ClearMappings();
 
 		// add sequence
 		if (!sequences)
@@ -336,6 +351,7 @@ public:
 
 	void RemoveSequence(int index) {
 		assert(sequences);
+		ClearMappings();
 
 		assert(index >= 0 && index < (int) sequences->size());
 		delete (*sequences)[index];
@@ -606,6 +622,43 @@ public:
 		return (int) sequences->size();
 	}
 
+	/////////////////////////////////////////////////////////////////
+	// MultiSequence::GetMapping()
+	//
+	// Returns the alignment column of every character of sequence i,
+	// with entry 0 set to 0, as Sequence::GetMapping() does.  The
+	// mappings of all sequences are computed together on first use
+	// and kept in one array until the sequences change; they must not
+	// be requested by several threads at once before that.
+	/////////////////////////////////////////////////////////////////
+
+	const int *GetMapping(int i) const {
+		assert(0 <= i && i < GetNumSequences());
+
+		if (mappingStarts.empty()) {
+			mappingStarts.resize(GetNumSequences() + 1);
+			for (int s = 0; s < GetNumSequences(); s++) {
+				mappingStarts[s] = mappingColumns.size();
+				mappingColumns.push_back(0);
+				(*sequences)[s]->AppendMapping(mappingColumns);
+			}
+			mappingStarts[GetNumSequences()] = mappingColumns.size();
+		}
+		return &mappingColumns[mappingStarts[i]];
+	}
+
+	/////////////////////////////////////////////////////////////////
+	// MultiSequence::GetMappingLength()
+	//
+	// Returns the number of characters of sequence i, i.e. the index
+	// of the last entry of its mapping.
+	/////////////////////////////////////////////////////////////////
+
+	int GetMappingLength(int i) const {
+		GetMapping(i);
+		return mappingStarts[i + 1] - mappingStarts[i] - 1;
+	}
+
 	/////////////////////////////////////////////////////////////////
 	// MultiSequence::SortByHeader()
 	//
@@ -615,6 +668,7 @@ public:
 
 	void SortByHeader() {
 		assert(sequences);
+		ClearMappings();
 
 		// a quick and easy O(n^2) sort
 		for (int i = 0; i < (int) sequences->size() - 1; i++) {
@@ -634,6 +688,7 @@ public:
 
 	void SortByLabel() {
 		assert(sequences);
+		ClearMappings();
 
 		// a quick and easy O(n^2) sort
 		for (int i = 0; i < (int) sequences->size() - 1; i++) {
@@ -669,67 +724,46 @@ public:
 	/////////////////////////////////////////////////////////////////
 
 	MultiSequence *Project(const set<int> &indices) {
-		SafeVector<SafeVector<char>::iterator> oldPtrs(indices.size());
-		SafeVector<SafeVector<char> *> newPtrs(indices.size());
-
 		assert(indices.size() != 0);
 
-		// grab old data
-		int i = 0;
-		for (set<int>::const_iterator iter = indices.begin();
-				iter != indices.end(); ++iter) {
-			oldPtrs[i++] = GetSequence(*iter)->GetDataPtr();
-		}
-
-		// compute new length
-		int oldLength = GetSequence(*indices.begin())->GetLength();
-		int newLength = 0;
-		for (i = 1; i <= oldLength; i++) {
-
-			// check to see if there is a gap in every sequence of the set
-			bool found = false;
-			for (int j = 0; !found && j < (int) indices.size(); j++)
-				found = (oldPtrs[j][i] != '-');
-
-			// if not, then this column counts towards the sequence length
-			if (found)
-				newLength++;
-		}
+		VI columns;
+		GetProjectionColumns(indices, columns);
 
-		// build new alignments
-		for (i = 0; i < (int) indices.size(); i++) {
-			newPtrs[i] = new SafeVector<char>();
-			assert(newPtrs[i]);
-			newPtrs[i]->push_back('@');
-		}
+		// wrap sequences in MultiSequence object
+		MultiSequence *ret = new MultiSequence();
+		for (set<int>::const_iterator iter = indices.begin();
+				iter != indices.end(); ++iter)
+			ret->AddSequence(GetSequence(*iter)->RemoveColumns(columns));
 
-		// add all needed columns
-		for (i = 1; i <= oldLength; i++) {
+		return ret;
+	}
 
-			// make sure column is not gapped in all sequences in the set
-			bool found = false;
-			for (int j = 0; !found && j < (int) indices.size(); j++)
-				found = (oldPtrs[j][i] != '-');
+	/////////////////////////////////////////////////////////////////
+	// MultiSequence::GetProjectionColumns()
+	//
+	// Computes the columns kept by Project() for the same indices:
+	// columns[i] is the number of columns up to column i that are not
+	// gapped in every sequence of the set, so column i is kept if
+	// columns[i] differs from columns[i-1].  Returns the length of
+	// the projection.
+	/////////////////////////////////////////////////////////////////
 
-			// if not, then add it
-			if (found) {
-				for (int j = 0; j < (int) indices.size(); j++)
-					newPtrs[j]->push_back(oldPtrs[j][i]);
-			}
-		}
+	int GetProjectionColumns(const set<int> &indices, VI &columns) const {
+		assert(indices.size() != 0);
+		const int oldLength = GetSequence(*indices.begin())->GetLength();
 
-		// wrap sequences in MultiSequence object
-		MultiSequence *ret = new MultiSequence();
-		i = 0;
+		// count the residues of the set in every column
+		VI coverage(oldLength + 2, 0);
 		for (set<int>::const_iterator iter = indices.begin();
-				iter != indices.end(); ++iter) {
-			ret->AddSequence(
-					new Sequence(newPtrs[i++], GetSequence(*iter)->GetHeader(),
-							newLength, GetSequence(*iter)->GetSortLabel(),
-							GetSequence(*iter)->GetLabel()));
-		}
+				iter != indices.end(); ++iter)
+			GetSequence(*iter)->AddResidueColumns(coverage);
 
-		return ret;
+		columns.assign(oldLength + 1, 0);
+		for (int i = 1, residues = 0; i <= oldLength; i++) {
+			residues += coverage[i];
+			columns[i] = columns[i - 1] + (residues > 0);
+		}
+		return columns[oldLength];
 	}
 };
 
@@ -0,0 +1,603 @@
+/////////////////////////////////////////////////////////////////
+// PairMatrixStore.h
+//
+// Triangular arena storage for the pairwise sparse posterior
+// matrices.
+/////////////////////////////////////////////////////////////////
+
+#ifndef PAIRMATRIXSTORE_H
+#define PAIRMATRIXSTORE_H
+
+#include <cstddef>
+#include "SafeVector.h"
+#include "SparseMatrix.h"
+#include "MultiSequence.h"
+#include "SpillFile.h"
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#ifdef GLPROBS_MPI
+#include <mpi.h>
+#endif
+
+/////////////////////////////////////////////////////////////////
+// PairMatrixView
+//
+// Orientation-aware handle to the posterior matrix of sequence s
+// against sequence t.  Only pairs with s < t are stored; for s > t
+// the view refers to the stored matrix of (t,s) with rows and
+// columns swapped, so no transpose is ever materialized.
+/////////////////////////////////////////////////////////////////
+
+class PairMatrixView {
+
+	SparseMatrix matrix;                            // stored matrix
+	bool transposed;         // rows of the view are columns of matrix
+
+public:
+
+	PairMatrixView(const SparseMatrix &matrix, bool transposed) :
+			matrix(matrix), transposed(transposed) {
+	}
+
+	/////////////////////////////////////////////////////////////////
+	// PairMatrixView::GetMatrix()
+	//
+	// Returns the stored matrix, whose rows run along the first
+	// sequence of the view unless IsTransposed() is true.
+	/////////////////////////////////////////////////////////////////
+
+	const SparseMatrix &GetMatrix() const {
+		return matrix;
+	}
+
+	bool IsTransposed() const {
+		return transposed;
+	}
+
+	/////////////////////////////////////////////////////////////////
+	// PairMatrixView::GetSeq1Length()
+	//
+	// Returns the length of the first sequence of the view.
+	/////////////////////////////////////////////////////////////////
+
+	int GetSeq1Length() const {
+		return transposed ? matrix.GetSeq2Length() : matrix.GetSeq1Length();
+	}
+
+	/////////////////////////////////////////////////////////////////
+	// PairMatrixView::GetSeq2Length()
+	//
+	// Returns the length of the second sequence of the view.
+	/////////////////////////////////////////////////////////////////
+
+	int GetSeq2Length() const {
+		return transposed ? matrix.GetSeq1Length() : matrix.GetSeq2Length();
+	}
+
+	/////////////////////////////////////////////////////////////////
+	// PairMatrixView::GetValue()
+	//
+	// Returns the posterior of aligning position row of the first
+	// sequence with position col of the second.
+	/////////////////////////////////////////////////////////////////
+
+	float GetValue(int row, int col) const {
+		return transposed ?
+				matrix.GetValue(col, row) : matrix.GetValue(row, col);
+	}
+};
+
+/////////////////////////////////////////////////////////////////
+// PairMatrixStore
+//
+// Holds the sparse matrix of every sequence pair (i,j), i < j,
+// indexed by its position in the row-major upper triangle.  The
+// column layouts of all pairs (row tables and column deltas) are
+// kept in one int slab and one byte slab, and their values in a
+// value slab, with every pair owning a fixed region of each, so a
+// matrix is only a few offsets and is handed out by value.
+//
+// Values are kept as 32-bit floats by default, in which case the
+// matrices handed out are views of the slabs.  The store may
+// instead quantize them to 8- or 16-bit codes through a
+// PosteriorCodec, so that 2-4 times as many values fit in memory;
+// matrices are then decoded into a caller-supplied scratch buffer
+// (or a buffer of their own) when they are fetched.
+//
+// The consistency transformation reads the current value slab and
+// writes the spare one, after which the two are swapped.  Because
+// a relaxed matrix is masked to the support of the matrix it was
+// computed from, it fits the column layout the pair was given when
+// the store was first filled; cells that drop below the threshold
+// are kept as zeros.  The layout is therefore shared by both value
+// slabs and no rep allocates or frees memory.
+//
+// For families whose matrices exceed main memory, the slabs may be
+// spilled to a memory-mapped file.  Pairs are laid out in the order
+// in which the consistency transformation visits them, so the file
+// is mostly read and written sequentially, and once the matrices
+// fetched or stored add up to the working set size all resident
+// pages of the slabs are written back and dropped.
+//
+// Built with MPI, every rank holds a replica of the store.  The
+// pairs are split into contiguous shares of about equal numbers of
+// cells, each rank relaxes its own share into the spare slab, and
+// ShareNext() then broadcasts every share to the other ranks.
+/////////////////////////////////////////////////////////////////
+
+class PairMatrixStore {
+
+	int numSeqs;                                    // number of sequences
+	int numPairs;                                   // number of pairs i < j
+	VI seqLengths;                                  // length of every sequence
+	SafeVector<size_t> rowBase;     // offset of each pair's row table in rowTables
+	SafeVector<size_t> cellBase;          // offset of each pair's cells in a slab
+	VI numCells;                                    // number of cells of each pair
+
+	SpillArray<int> rowTables;                      // row tables of all pairs
+	SpillArray<unsigned char> columns;              // column deltas of all pairs
+	PosteriorCodec codec;                           // form of the stored values
+	SpillArray<unsigned char> values[2];            // values of all pairs
+	int current;                             // index of the current value slab
+
+	SpillFile *spillFile;                   // file holding the slabs, if any
+	SpillFile *stagingFile;          // file holding staged cells, if spilling
+	size_t workingSet;                  // bytes touched between evictions
+	mutable size_t touched;                 // bytes touched since last eviction
+
+	// cells staged by each thread before the slabs are packed
+	SafeVector<SafeVector<unsigned char> > stagedColumns;
+	SafeVector<VF> stagedValues;
+	VI stagedThread;                // thread that staged each pair
+	SafeVector<size_t> stagedOffset;    // offset of each pair in its staging buffers
+
+	PairMatrixStore(const PairMatrixStore &);
+	PairMatrixStore &operator=(const PairMatrixStore &);
+
+	/////////////////////////////////////////////////////////////////
+	// PairMatrixStore::BindMatrix()
+	//
+	// Returns a matrix bound to the layout of pair (i,j) and to the
+	// given value buffer.
+	/////////////////////////////////////////////////////////////////
+
+	SparseMatrix BindMatrix(int i, int j, float *pairValues) const {
+		int pairIdx = GetPairIndex(i, j);
+		SparseMatrix matrix;
+		matrix.Bind(seqLengths[i], seqLengths[j],
+				const_cast<int *>(&rowTables[rowBase[pairIdx]]),
+				columns.empty() ?
+						NULL :
+						const_cast<unsigned char *>(&columns[cellBase[pairIdx]]),
+				pairValues);
+		return matrix;
+	}
+
+	/////////////////////////////////////////////////////////////////
+	// PairMatrixStore::GetStored()
+	//
+	// Returns the stored values of pair (i,j) in a value slab.
+	/////////////////////////////////////////////////////////////////
+
+	unsigned char *GetStored(SpillArray<unsigned char> &slab, int i, int j) const {
+		if (slab.empty())
+			return NULL;
+		return &slab[cellBase[GetPairIndex(i, j)] * codec.GetBytes()];
+	}
+
+	/////////////////////////////////////////////////////////////////
+	// PairMatrixStore::Touch()
+	//
+	// Accounts for the given number of slab bytes being accessed, and
+	// evicts the slabs from memory when spilling and the working set
+	// size is reached.  May be called concurrently.
+	/////////////////////////////////////////////////////////////////
+
+	void Touch(size_t bytes) const {
+		if (!spillFile)
+			return;
+		bool evict = false;
+#ifdef _OPENMP
+#pragma omp critical(PairMatrixStoreTouch)
+#endif
+		{
+			touched += bytes;
+			if (touched >= workingSet) {
+				touched = 0;
+				evict = true;
+			}
+		}
+		if (evict) {
+			rowTables.Evict();
+			columns.Evict();
+			values[0].Evict();
+			values[1].Evict();
+		}
+	}
+
+	/////////////////////////////////////////////////////////////////
+	// PairMatrixStore::Touch()
+	//
+	// Accounts for the slab memory of pair (i,j) being accessed.
+	/////////////////////////////////////////////////////////////////
+
+	void Touch(int i, int j) const {
+		Touch((seqLengths[i] + 2) * sizeof(int)
+				+ numCells[GetPairIndex(i, j)] * (1 + codec.GetBytes()));
+	}
+
+	/////////////////////////////////////////////////////////////////
+	// PairMatrixStore::GetCellOffset()
+	//
+	// Returns the offset of the cells of pair pairIdx in a slab, or
+	// the total number of cells if pairIdx is numPairs.
+	/////////////////////////////////////////////////////////////////
+
+	size_t GetCellOffset(int pairIdx) const {
+		return pairIdx < numPairs ? cellBase[pairIdx] : columns.size();
+	}
+
+public:
+
+	/////////////////////////////////////////////////////////////////
+	// PairMatrixStore::PairMatrixStore()
+	//
+	// Constructor.  Lays out the row tables of every pair of
+	// sequences; cells are added through Stage() and Pack().  Values
+	// are stored with valueBits bits each (8, 16 or 32).  If a spill
+	// directory is given, the slabs are kept in a file there, with
+	// about workingSet bytes of them resident at any time.
+	/////////////////////////////////////////////////////////////////
+
+	PairMatrixStore(MultiSequence *sequences, int valueBits = 32,
+			const string &spillDirectory = "", size_t workingSet = 0) :
+			numSeqs(sequences->GetNumSequences()), codec(valueBits), current(0), spillFile(
+					NULL), stagingFile(NULL), workingSet(workingSet), touched(0) {
+		if (spillDirectory != "") {
+			spillFile = new SpillFile(spillDirectory);
+			stagingFile = new SpillFile(spillDirectory);
+		}
+		numPairs = numSeqs * (numSeqs - 1) / 2;
+
+		seqLengths.resize(numSeqs);
+		for (int i = 0; i < numSeqs; i++)
+			seqLengths[i] = sequences->GetSequence(i)->GetLength();
+
+		// each pair holds a row table of seq1Length+2 entries
+		rowBase.resize(numPairs);
+		size_t numRows = 0;
+		for (int i = 0; i < numSeqs; i++) {
+			for (int j = i + 1; j < numSeqs; j++) {
+				rowBase[GetPairIndex(i, j)] = numRows;
+				numRows += seqLengths[i] + 2;
+			}
+		}
+		rowTables.Allocate(numRows, spillFile);
+
+		cellBase.resize(numPairs);
+		numCells.resize(numPairs);
+		stagedThread.resize(numPairs);
+		stagedOffset.resize(numPairs);
+#ifdef _OPENMP
+		stagedColumns.resize(omp_get_max_threads());
+		stagedValues.resize(omp_get_max_threads());
+#else
+		stagedColumns.resize(1);
+		stagedValues.resize(1);
+#endif
+	}
+
+	~PairMatrixStore() {
+		delete spillFile;
+		delete stagingFile;
+	}
+
+	/////////////////////////////////////////////////////////////////
+	// PairMatrixStore::GetPairIndex()
+	//
+	// Returns the position of pair (i,j), i < j, in the row-major
+	// upper triangle.
+	/////////////////////////////////////////////////////////////////
+
+	int GetPairIndex(int i, int j) const {
+		assert(0 <= i && i < j && j < numSeqs);
+		return (int) ((long) i * (2 * numSeqs - i - 1) / 2) + j - i - 1;
+	}
+
+	/////////////////////////////////////////////////////////////////
+	// PairMatrixStore::GetMemoryUsage()
+	//
+	// Returns the number of bytes taken by the row tables, column
+	// deltas and value slabs.
+	/////////////////////////////////////////////////////////////////
+
+	size_t GetMemoryUsage() const {
+		return rowTables.size() * sizeof(int) + columns.size()
+				+ values[0].size() + values[1].size();
+	}
+
+	/////////////////////////////////////////////////////////////////
+	// PairMatrixStore::GetNumSequences()
+	//
+	// Returns the number of sequences.
+	/////////////////////////////////////////////////////////////////
+
+	int GetNumSequences() const {
+		return numSeqs;
+	}
+
+	/////////////////////////////////////////////////////////////////
+	// PairMatrixStore::GetSeqLength()
+	//
+	// Returns the length of sequence i.
+	/////////////////////////////////////////////////////////////////
+
+	int GetSeqLength(int i) const {
+		return seqLengths[i];
+	}
+
+	/////////////////////////////////////////////////////////////////
+	// PairMatrixStore::Stage()
+	//
+	// Sparsifies the posterior matrix of pair (i,j) into the staging
+	// buffers of the calling thread, or into the staging file when
+	// spilling.  May be called concurrently for different pairs.
+	/////////////////////////////////////////////////////////////////
+
+	void Stage(int i, int j, const VF &posterior) {
+		int pairIdx = GetPairIndex(i, j);
+#ifdef _OPENMP
+		int tid = omp_get_thread_num();
+#else
+		int tid = 0;
+#endif
+		SafeVector<unsigned char> &columnBuffer = stagedColumns[tid];
+		VF &valueBuffer = stagedValues[tid];
+		int pairCells = SparseMatrix::CountCells(seqLengths[i], seqLengths[j],
+				posterior);
+		size_t offset = stagingFile ? 0 : valueBuffer.size();
+		columnBuffer.resize(offset + pairCells);
+		valueBuffer.resize(offset + pairCells);
+
+		SparseMatrix matrix;
+		matrix.Assign(seqLengths[i], seqLengths[j], posterior,
+				&rowTables[rowBase[pairIdx]],
+				pairCells ? &columnBuffer[offset] : NULL,
+				pairCells ? &valueBuffer[offset] : NULL);
+
+		// values are staged ahead of the column deltas
+		if (stagingFile) {
+			offset = stagingFile->Reserve(pairCells * (sizeof(float) + 1));
+			stagingFile->Write(&valueBuffer[0], pairCells * sizeof(float),
+					offset);
+			stagingFile->Write(&columnBuffer[0], pairCells,
+					offset + pairCells * sizeof(float));
+		}
+
+		numCells[pairIdx] = pairCells;
+		stagedThread[pairIdx] = tid;
+		stagedOffset[pairIdx] = offset;
+		Touch(i, j);
+	}
+
+	/////////////////////////////////////////////////////////////////
+	// PairMatrixStore::Pack()
+	//
+	// Moves the staged cells of all pairs into the slabs, in pair
+	// order, and releases the staging buffers or file.
+	/////////////////////////////////////////////////////////////////
+
+	void Pack() {
+		size_t totalCells = 0;
+		for (int pairIdx = 0; pairIdx < numPairs; pairIdx++) {
+			cellBase[pairIdx] = totalCells;
+			totalCells += numCells[pairIdx];
+		}
+
+		columns.Allocate(totalCells, spillFile);
+		values[current].Allocate(totalCells * codec.GetBytes(), spillFile);
+		VF pairValues;
+		for (int pairIdx = 0; pairIdx < numPairs; pairIdx++) {
+			if (numCells[pairIdx] == 0)
+				continue;
+			if (stagingFile) {
+				size_t pairCells = numCells[pairIdx];
+				pairValues.resize(pairCells);
+				stagingFile->Read(&pairValues[0], pairCells * sizeof(float),
+						stagedOffset[pairIdx]);
+				stagingFile->Read(&columns[cellBase[pairIdx]], pairCells,
+						stagedOffset[pairIdx] + pairCells * sizeof(float));
+				codec.Encode(&pairValues[0], pairCells,
+						&values[current][cellBase[pairIdx] * codec.GetBytes()]);
+				Touch(pairCells * (1 + codec.GetBytes()));
+				continue;
+			}
+			int tid = stagedThread[pairIdx];
+			const unsigned char *srcColumns =
+					&stagedColumns[tid][stagedOffset[pairIdx]];
+			copy(srcColumns, srcColumns + numCells[pairIdx],
+					&columns[cellBase[pairIdx]]);
+			codec.Encode(&stagedValues[tid][stagedOffset[pairIdx]],
+					numCells[pairIdx], &values[current][cellBase[pairIdx]
+							* codec.GetBytes()]);
+		}
+		SafeVector<SafeVector<unsigned char> >(stagedColumns.size()).swap(
+				stagedColumns);
+		SafeVector<VF>(stagedValues.size()).swap(stagedValues);
+		delete stagingFile;
+		stagingFile = NULL;
+	}
+
+	/////////////////////////////////////////////////////////////////
+	// PairMatrixStore::GetMatrix()
+	//
+	// Returns the current sparse matrix of pair (i,j), i < j.  With
+	// quantized values the matrix holds its own decoded copy of them.
+	/////////////////////////////////////////////////////////////////
+
+	SparseMatrix GetMatrix(int i, int j) const {
+		Touch(i, j);
+
+		// matrices handed out by a const store still refer to its slabs
+		unsigned char *stored = GetStored(
+				const_cast<SpillArray<unsigned char> &>(values[current]), i, j);
+		if (!codec.IsQuantized())
+			return BindMatrix(i, j, (float *) stored);
+
+		SparseMatrix matrix = BindMatrix(i, j, NULL);
+		codec.Decode(stored, matrix.GetNumValues(), matrix.AllocateValues());
+		return matrix;
+	}
+
+	/////////////////////////////////////////////////////////////////
+	// PairMatrixStore::GetMatrix()
+	//
+	// Returns the current sparse matrix of pair (i,j), i < j, decoding
+	// quantized values into scratch.  The matrix is valid until
+	// scratch is reused.
+	/////////////////////////////////////////////////////////////////
+
+	SparseMatrix GetMatrix(int i, int j, VF &scratch) const {
+		Touch(i, j);
+		unsigned char *stored = GetStored(
+				const_cast<SpillArray<unsigned char> &>(values[current]), i, j);
+		if (!codec.IsQuantized())
+			return BindMatrix(i, j, (float *) stored);
+
+		SparseMatrix matrix = BindMatrix(i, j, NULL);
+		scratch.resize(matrix.GetNumValues() + 1);
+		codec.Decode(stored, matrix.GetNumValues(), &scratch[0]);
+		return BindMatrix(i, j, &scratch[0]);
+	}
+
+	/////////////////////////////////////////////////////////////////
+	// PairMatrixStore::GetView()
+	//
+	// Returns the current posterior matrix of sequence s against
+	// sequence t, s != t, in whichever orientation it is stored.
+	/////////////////////////////////////////////////////////////////
+
+	PairMatrixView GetView(int s, int t) const {
+		assert(s != t);
+		if (s < t)
+			return PairMatrixView(GetMatrix(s, t), false);
+		return PairMatrixView(GetMatrix(t, s), true);
+	}
+
+	PairMatrixView GetView(int s, int t, VF &scratch) const {
+		assert(s != t);
+		if (s < t)
+			return PairMatrixView(GetMatrix(s, t, scratch), false);
+		return PairMatrixView(GetMatrix(t, s, scratch), true);
+	}
+
+	/////////////////////////////////////////////////////////////////
+	// PairMatrixStore::StoreNext()
+	//
+	// Writes the posterior matrix of pair (i,j) into the spare value
+	// slab.  Only the cells of the pair's column layout are read, and
+	// those outside the support of the current matrix of the pair
+	// must be zero.  Quantized values are encoded from scratch, to
+	// which the returned matrix is bound.  May be called concurrently
+	// for different pairs.
+	/////////////////////////////////////////////////////////////////
+
+	SparseMatrix StoreNext(int i, int j, const VF &posterior, VF &scratch) {
+		Touch(i, j);
+		unsigned char *stored = GetStored(values[1 - current], i, j);
+		if (!codec.IsQuantized()) {
+			SparseMatrix matrix = BindMatrix(i, j, (float *) stored);
+			matrix.Refill(posterior);
+			return matrix;
+		}
+
+		SparseMatrix matrix = BindMatrix(i, j, NULL);
+		scratch.resize(matrix.GetNumValues() + 1);
+		matrix = BindMatrix(i, j, &scratch[0]);
+		matrix.Refill(posterior);
+		codec.Encode(&scratch[0], matrix.GetNumValues(), stored);
+		return matrix;
+	}
+
+	/////////////////////////////////////////////////////////////////
+	// PairMatrixStore::PrepareNext()
+	//
+	// Allocates the spare value slab.  Does nothing if it already
+	// exists.
+	/////////////////////////////////////////////////////////////////
+
+	void PrepareNext() {
+		values[1 - current].Allocate(values[current].size(), spillFile);
+	}
+
+	/////////////////////////////////////////////////////////////////
+	// PairMatrixStore::Swap()
+	//
+	// Makes the spare value slab, filled through StoreNext(), current.
+	/////////////////////////////////////////////////////////////////
+
+	void Swap() {
+		current = 1 - current;
+	}
+
+	/////////////////////////////////////////////////////////////////
+	// PairMatrixStore::ReleaseNext()
+	//
+	// Frees the spare value slab once no more reps are to be run.
+	/////////////////////////////////////////////////////////////////
+
+	void ReleaseNext() {
+		values[1 - current].Release();
+	}
+
+	/////////////////////////////////////////////////////////////////
+	// PairMatrixStore::GetShareStart()
+	//
+	// Returns the first pair of share part when the pairs are split
+	// into numParts contiguous shares of about equal numbers of
+	// cells.  Share numParts starts at numPairs.
+	/////////////////////////////////////////////////////////////////
+
+	int GetShareStart(int part, int numParts) const {
+		if (part >= numParts)
+			return numPairs;
+		size_t target = (size_t) ((double) columns.size() * part / numParts);
+		return lower_bound(cellBase.begin(), cellBase.end(), target)
+				- cellBase.begin();
+	}
+
+#ifdef GLPROBS_MPI
+	/////////////////////////////////////////////////////////////////
+	// PairMatrixStore::ShareNext()
+	//
+	// Broadcasts the spare values of every share of pairs, as given
+	// by GetShareStart(), from the rank of comm that stored them, so
+	// that all ranks hold the whole spare slab.
+	/////////////////////////////////////////////////////////////////
+
+	void ShareNext(MPI_Comm comm) {
+		int numRanks;
+		MPI_Comm_size(comm, &numRanks);
+		SpillArray<unsigned char> &slab = values[1 - current];
+
+		// MPI counts are ints, so shares are sent in pieces
+		const size_t pieceBytes = 1 << 26;
+		for (int rank = 0; rank < numRanks; rank++) {
+			size_t begin = GetCellOffset(GetShareStart(rank, numRanks))
+					* codec.GetBytes();
+			size_t end = GetCellOffset(GetShareStart(rank + 1, numRanks))
+					* codec.GetBytes();
+			for (size_t offset = begin; offset < end; offset += pieceBytes) {
+				size_t bytes = min(end - offset, pieceBytes);
+				MPI_Bcast(&slab[offset], (int) bytes, MPI_BYTE, rank, comm);
+				Touch(bytes);
+			}
+		}
+	}
+#endif
+};
+
+#endif
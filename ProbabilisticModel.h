@@ -11,16 +11,24 @@
 #define PROBABILISTICMODEL_H
 
 #include <list>
+#include <algorithm>
 #include <cmath>
 #include <cstdio>
 #include "SafeVector.h"
 #include "ScoreType.h"
 #include "SparseMatrix.h"
 #include "MultiSequence.h"
+#include "PairMatrixStore.h"
+#include "ProfilePosterior.h"
+#include "ProfileAggregate.h"
+#include "ScratchArena.h"
 
 #ifdef _OPENMP
 #include <omp.h>
 #endif
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 using namespace std;
 
@@ -28,6 +36,17 @@ const int NumMatchStates = 1;
 const int NumInsertStates = 2;                                             // for double affine pair-HMM 
 const int NumMatrixTypes = NumMatchStates + NumInsertStates * 2;
 
+// profile posteriors are built in parallel when the number of sequence
+// pairs times the summed profile lengths reaches this
+const double PARALLEL_POSTERIOR_WORK = 1 << 16;
+// number of sequence pairs per thread added to a profile posterior at once
+const int POSTERIOR_BATCH_PER_THREAD = 4;
+// profile posteriors of more cells are kept sparse and aligned in linear space
+const double LINEAR_SPACE_CELLS = 1 << 26;
+// profile pairs are aligned over the band around their nonzero posteriors
+// when it holds at most this fraction of the cells
+const double SUPPORT_BAND_FRACTION = 0.2;
+
 /////////////////////////////////////////////////////////////////
 // ProbabilisticModel
 //
@@ -803,15 +822,234 @@ gapExtend[1]:central extend gap probability
 
   pair<SafeVector<char> *, float> ComputeAlignment (int seq1Length, int seq2Length,
                                                     const VF &posterior) const {
+    return AlignDense (seq1Length, seq2Length, &posterior[0]);
+  }
+
+  /////////////////////////////////////////////////////////////////
+  // ProbabilisticModel::AlignDense()
+  //
+  // Computes the alignment of ComputeAlignment() for the cells of
+  // a dense posterior matrix, row after row.
+  /////////////////////////////////////////////////////////////////
+
+#ifdef __SSE2__
+  // Rows are computed in bands of four, one row per SIMD lane, with
+  // lane k lagging k columns behind lane 0: at step t, lane k fills
+  // cell (i+k, t-k), whose upper and diagonal neighbours were filled
+  // by lane k-1 in the two previous steps.  The choice made for a
+  // cell is kept as two bits, the outcomes of the two comparisons
+  // of ChooseBestOfThree(), and the bits of the four lanes of one
+  // step share a byte.  Every cell is computed with the same
+  // operations in the same order as in the scalar loop, so ties are
+  // broken identically.
+
+  pair<SafeVector<char> *, float> AlignDense (int seq1Length, int seq2Length,
+                                              const float *posterior) const {
+    DenseRows rows = { posterior, seq2Length + 1 };
+    return AlignRows (rows, seq1Length, seq2Length, seq1Length);
+  }
+
+  // Row access to a dense posterior matrix, as in ProfilePosterior.
+  struct DenseRows {
+    const float *cells;
+    int stride;
+
+    const float *GetRow (int row, float *) const {
+      return cells + (size_t) row * stride;
+    }
+  };
+
+  /////////////////////////////////////////////////////////////////
+  // ProbabilisticModel::FillBands()
+  //
+  // Fills rows firstRow to lastRow of the matrix of
+  // ComputeAlignment(), given row firstRow-1 in oldRow, and leaves
+  // row lastRow in oldRow.  The traceback bits are written to bits
+  // unless it is NULL, numSteps bytes per band.  The posterior rows
+  // are read with rows.GetRow(), which may expand them into the
+  // buffers, room for four rows.
+  /////////////////////////////////////////////////////////////////
+
+  template <class Rows>
+  static void FillBands (const Rows &rows, int firstRow, int lastRow, int seq2Length,
+                         float *&oldRow, float *&newRow, float *buffers,
+                         unsigned char *bits){
+
+    const int stride = seq2Length + 1;
+    const int numSteps = seq2Length + 3;
+
+    // lanes already past column 0 in each of the first steps
+    const __m128 startMasks[4] = {
+      _mm_setzero_ps(),
+      _mm_castsi128_ps (_mm_set_epi32 (0, 0, 0, -1)),
+      _mm_castsi128_ps (_mm_set_epi32 (0, 0, -1, -1)),
+      _mm_castsi128_ps (_mm_set_epi32 (0, -1, -1, -1))
+    };
+
+    for (int bandRow = firstRow; bandRow <= lastRow; bandRow += 4){
+      const int numLanes = min (4, lastRow - bandRow + 1);
+
+      // posterior of cell (bandRow+k, t-k) is at rowPtrs[k][t]
+      const float *rowPtrs[4];
+      for (int k = 0; k < 4; k++)
+        rowPtrs[k] = k < numLanes ? rows.GetRow (bandRow + k, buffers + k * stride) - k : NULL;
+
+      unsigned char *bandBits = bits ? bits + (size_t) ((bandRow - firstRow) / 4) * numSteps : NULL;
+      __m128 left = _mm_setzero_ps();       // cells filled in the last step
+      __m128 lastLeft = _mm_setzero_ps();   // cells filled the step before
+      float values[4];
+
+      for (int t = 1; t <= numSteps; t++){
+        __m128 post;
+        if (numLanes == 4 && t >= 4 && t <= seq2Length)
+          post = _mm_set_ps (rowPtrs[3][t], rowPtrs[2][t], rowPtrs[1][t], rowPtrs[0][t]);
+        else {
+          for (int k = 0; k < 4; k++)
+            values[k] = (k < numLanes && t - k >= 1 && t - k <= seq2Length) ? rowPtrs[k][t] : 0;
+          post = _mm_loadu_ps (values);
+        }
+
+        // lane 0 reads the last row of the previous band
+        __m128 up = _mm_castsi128_ps (_mm_slli_si128 (_mm_castps_si128 (left), 4));
+        up = _mm_move_ss (up, _mm_set_ss (t <= seq2Length ? oldRow[t] : 0));
+        __m128 diag = _mm_castsi128_ps (_mm_slli_si128 (_mm_castps_si128 (lastLeft), 4));
+        diag = _mm_move_ss (diag, _mm_set_ss (t <= seq2Length + 1 ? oldRow[t-1] : 0));
+
+        // ChooseBestOfThree (post + diag, left, up, 'D', 'L', 'U', ...)
+        __m128 x1 = _mm_add_ps (post, diag);
+        __m128 first = _mm_cmpge_ps (x1, left);
+        __m128 best = _mm_or_ps (_mm_and_ps (first, x1), _mm_andnot_ps (first, left));
+        __m128 second = _mm_cmpge_ps (best, up);
+        best = _mm_or_ps (_mm_and_ps (second, best), _mm_andnot_ps (second, up));
+
+        // lanes still at or before column 0 hold the zero of that column
+        if (t < 4)
+          best = _mm_and_ps (best, startMasks[t]);
+        if (bandBits)
+          bandBits[t-1] = (unsigned char) (_mm_movemask_ps (first) | (_mm_movemask_ps (second) << 4));
+
+        lastLeft = left;
+        left = best;
+
+        // keep the last row of the band for the next one
+        const int col = t - (numLanes - 1);
+        if (col >= 1 && col <= seq2Length){
+          _mm_storeu_ps (values, best);
+          newRow[col] = values[numLanes - 1];
+        }
+      }
+
+      // swap rows
+      float *temp = oldRow;
+      oldRow = newRow;
+      newRow = temp;
+    }
+  }
 
-    float *twoRows = new float[(seq2Length+1)*2]; assert (twoRows);
+  /////////////////////////////////////////////////////////////////
+  // ProbabilisticModel::TraceBands()
+  //
+  // Follows the traceback bits written by FillBands() for the rows
+  // from firstRow on, starting at cell (r, c), until r leaves them.
+  /////////////////////////////////////////////////////////////////
+
+  static void TraceBands (const unsigned char *bits, int firstRow, int seq2Length,
+                          int &r, int &c, SafeVector<char> *alignment){
+    const int numSteps = seq2Length + 3;
+    while (r >= firstRow){
+      if (c == 0){ r--; alignment->push_back ('X'); continue; }
+      const int lane = (r - firstRow) % 4;
+      const unsigned char cellBits = bits[(size_t) ((r - firstRow) / 4) * numSteps + c + lane - 1];
+      if (!((cellBits >> (4 + lane)) & 1)){ r--; alignment->push_back ('X'); }
+      else if ((cellBits >> lane) & 1){ c--; r--; alignment->push_back ('B'); }
+      else { c--; alignment->push_back ('Y'); }
+    }
+  }
+
+  /////////////////////////////////////////////////////////////////
+  // ProbabilisticModel::AlignRows()
+  //
+  // Computes the alignment of ComputeAlignment() in blocks of
+  // blockRows rows, a multiple of four unless there is a single
+  // block.  The rows are filled once, keeping only the row above
+  // each block, and then each block is filled again from that row,
+  // last block first, to follow the traceback through it.  Only the
+  // traceback bits of one block are kept at a time.  The rows and
+  // traceback are taken from the scratch arena of the thread.
+  /////////////////////////////////////////////////////////////////
+
+  template <class Rows>
+  pair<SafeVector<char> *, float> AlignRows (const Rows &rows, int seq1Length,
+                                             int seq2Length, int blockRows) const {
+
+    SafeVector<char> *alignment = new SafeVector<char>; assert (alignment);
+    if (seq1Length == 0 || seq2Length == 0){
+      alignment->resize (seq1Length, 'X');
+      alignment->resize (seq1Length + seq2Length, 'Y');
+      return make_pair(alignment, 0.0f);
+    }
+
+    const int stride = seq2Length + 1;
+    const int numSteps = seq2Length + 3;
+    const int numBlocks = (seq1Length + blockRows - 1) / blockRows;
+    assert (numBlocks == 1 || blockRows % 4 == 0);
+
+    ScratchArena &arena = ScratchArena::GetThreadArena();
+    ScratchScope scope (arena);
+
+    float *twoRows = arena.Allocate<float> (stride*2);
+    float *oldRow = twoRows;
+    float *newRow = twoRows + stride;
+    for (int j = 0; j <= seq2Length; j++)
+      oldRow[j] = 0;
+    newRow[0] = 0;
+
+    float *buffers = arena.Allocate<float> (stride*4);
+    float *checkpoints = arena.Allocate<float> ((size_t) numBlocks * stride);
+    unsigned char *tracebackBits =
+      arena.Allocate<unsigned char> ((size_t) ((min (blockRows, seq1Length) + 3) / 4) * numSteps);
+
+    // fill in matrix, keeping the traceback of the last block
+    for (int block = 0; block < numBlocks; block++){
+      memcpy (checkpoints + (size_t) block * stride, oldRow, stride * sizeof(float));
+      FillBands (rows, block * blockRows + 1, min ((block + 1) * blockRows, seq1Length), seq2Length,
+                 oldRow, newRow, buffers, block == numBlocks - 1 ? tracebackBits : NULL);
+    }
+
+    // store best score
+    float total = oldRow[seq2Length];
+
+    // compute traceback
+    int r = seq1Length, c = seq2Length;
+    for (int block = numBlocks - 1; block >= 0; block--){
+      if (block < numBlocks - 1){
+        memcpy (oldRow, checkpoints + (size_t) block * stride, stride * sizeof(float));
+        FillBands (rows, block * blockRows + 1, (block + 1) * blockRows, seq2Length,
+                   oldRow, newRow, buffers, tracebackBits);
+      }
+      TraceBands (tracebackBits, block * blockRows + 1, seq2Length, r, c, alignment);
+    }
+    while (c != 0){ c--; alignment->push_back ('Y'); }
+
+    reverse (alignment->begin(), alignment->end());
+
+    return make_pair(alignment, total);
+  }
+#else
+  pair<SafeVector<char> *, float> AlignDense (int seq1Length, int seq2Length,
+                                              const float *posterior) const {
+
+    ScratchArena &arena = ScratchArena::GetThreadArena();
+    ScratchScope scope (arena);
+
+    float *twoRows = arena.Allocate<float> ((seq2Length+1)*2);
     float *oldRow = twoRows;
     float *newRow = twoRows + seq2Length + 1;
 
-    char *tracebackMatrix = new char[(seq1Length+1)*(seq2Length+1)]; assert (tracebackMatrix);
+    char *tracebackMatrix = arena.Allocate<char> ((size_t) (seq1Length+1)*(seq2Length+1));
     char *tracebackPtr = tracebackMatrix;
 
-    VF::const_iterator posteriorPtr = posterior.begin() + seq2Length + 1;
+    const float *posteriorPtr = posterior + seq2Length + 1;
 
     // initialization
     for (int i = 0; i <= seq2Length; i++){
@@ -841,13 +1079,12 @@ gapExtend[1]:central extend gap probability
 
     // store best score
     float total = oldRow[seq2Length];
-    delete [] twoRows;
 
     // compute traceback
     SafeVector<char> *alignment = new SafeVector<char>; assert (alignment);
     int r = seq1Length, c = seq2Length;
     while (r != 0 || c != 0){
-      char ch = tracebackMatrix[r*(seq2Length+1) + c];
+      char ch = tracebackMatrix[(size_t) r*(seq2Length+1) + c];
       switch (ch){
       case 'L': c--; alignment->push_back ('Y'); break;
       case 'U': r--; alignment->push_back ('X'); break;
@@ -856,12 +1093,272 @@ gapExtend[1]:central extend gap probability
       }
     }
 
-    delete [] tracebackMatrix;
-
     reverse (alignment->begin(), alignment->end());
     
     return make_pair(alignment, total);
   }
+#endif
+
+  /////////////////////////////////////////////////////////////////
+  // ProbabilisticModel::ComputeAlignment()
+  //
+  // Same as above for a posterior matrix built by
+  // BuildProfilePosterior().  When the band of cells around the
+  // nonzero posteriors is narrow enough, only the band is filled.
+  // Otherwise, a sparse matrix is aligned in blocks of about the
+  // square root of its number of rows, so that neither the matrix
+  // nor the traceback is ever held whole.
+  /////////////////////////////////////////////////////////////////
+
+  pair<SafeVector<char> *, float> ComputeAlignment (int seq1Length, int seq2Length,
+                                                    const ProfilePosterior &posterior) const {
+    SupportBand band (posterior);
+    if ((double) band.GetNumCells() <= SUPPORT_BAND_FRACTION * seq1Length * seq2Length
+        && (!posterior.IsSparse() || band.GetNumCells() <= LINEAR_SPACE_CELLS))
+      return AlignSupport (posterior, band);
+#ifdef __SSE2__
+    if (posterior.IsSparse())
+      return AlignRows (posterior, seq1Length, seq2Length,
+                        4 * (int) ceil (sqrt ((double) seq1Length)));
+#endif
+    return AlignDense (seq1Length, seq2Length, posterior.GetDense());
+  }
+
+  /////////////////////////////////////////////////////////////////
+  // ProbabilisticModel::ComputeAnchoredAlignment()
+  //
+  // Same as ComputeAlignment() for a dense posterior matrix, except
+  // that the cells above threshold are taken as anchors: the longest
+  // chain of them that increases in both rows and columns is
+  // matched, and only the segments between consecutive anchors are
+  // aligned, concurrently.  The result is that of ComputeAlignment()
+  // whenever its path goes through every anchor of the chain.
+  /////////////////////////////////////////////////////////////////
+
+  pair<SafeVector<char> *, float> ComputeAnchoredAlignment (int seq1Length, int seq2Length,
+                                                            const ProfilePosterior &posterior,
+                                                            float threshold) const {
+    if (posterior.IsSparse())
+      return ComputeAlignment (seq1Length, seq2Length, posterior);
+
+    const float *cells = posterior.GetDense();
+    const int stride = seq2Length + 1;
+
+    // cells above threshold, by row, right to left within a row so
+    // that a chain takes at most one cell of each row
+    VI rows, cols;
+    for (int i = 1; i <= seq1Length; i++){
+      int first, last;
+      posterior.GetSupport (i, first, last);
+      const float *row = cells + (size_t) i * stride;
+      for (int j = last; j >= max (first, 1); j--)
+        if (row[j] > threshold){
+          rows.push_back (i);
+          cols.push_back (j);
+        }
+    }
+
+    // longest chain of strictly increasing columns
+    VI tails, prev (rows.size(), -1);
+    for (int k = 0; k < (int) rows.size(); k++){
+      const int pos = lower_bound (tails.begin(), tails.end(), k, ColumnBefore (cols)) - tails.begin();
+      if (pos > 0)
+        prev[k] = tails[pos-1];
+      if (pos == (int) tails.size())
+        tails.push_back (k);
+      else
+        tails[pos] = k;
+    }
+    if (tails.empty())
+      return ComputeAlignment (seq1Length, seq2Length, posterior);
+    VI anchors;
+    for (int k = tails.back(); k >= 0; k = prev[k])
+      anchors.push_back (k);
+    reverse (anchors.begin(), anchors.end());
+
+    // align the segments between anchors
+    const int numSegments = anchors.size() + 1;
+    SafeVector<pair<SafeVector<char> *, float> > segments (numSegments);
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic) if (!omp_in_parallel())
+#endif
+    for (int k = 0; k < numSegments; k++){
+      const int r0 = k == 0 ? 0 : rows[anchors[k-1]];
+      const int c0 = k == 0 ? 0 : cols[anchors[k-1]];
+      const int r1 = k == numSegments - 1 ? seq1Length + 1 : rows[anchors[k]];
+      const int c1 = k == numSegments - 1 ? seq2Length + 1 : cols[anchors[k]];
+      const int length1 = r1 - r0 - 1, length2 = c1 - c0 - 1;
+
+      // the cells of the segment, with the anchor row and column above
+      // and left of it as row and column 0
+      ScratchArena &arena = ScratchArena::GetThreadArena();
+      ScratchScope scope (arena);
+      float *segment = arena.Allocate<float> ((size_t) (length1 + 1) * (length2 + 1));
+      for (int i = 0; i <= length1; i++)
+        memcpy (segment + (size_t) i * (length2 + 1), cells + (size_t) (r0 + i) * stride + c0,
+                (length2 + 1) * sizeof(float));
+      segments[k] = AlignDense (length1, length2, segment);
+    }
+
+    SafeVector<char> *alignment = new SafeVector<char>; assert (alignment);
+    alignment->reserve (seq1Length + seq2Length);
+    float total = 0;
+    for (int k = 0; k < numSegments; k++){
+      alignment->insert (alignment->end(), segments[k].first->begin(), segments[k].first->end());
+      total += segments[k].second;
+      delete segments[k].first;
+      if (k < numSegments - 1){
+        alignment->push_back ('B');
+        total += posterior.GetValue (rows[anchors[k]], cols[anchors[k]]);
+      }
+    }
+
+    return make_pair(alignment, total);
+  }
+
+  // Orders anchor candidates by column.
+  struct ColumnBefore {
+    const VI &cols;
+
+    ColumnBefore (const VI &cols) : cols (cols) {}
+
+    bool operator() (int a, int b) const {
+      return cols[a] < cols[b];
+    }
+  };
+
+  /////////////////////////////////////////////////////////////////
+  // ProbabilisticModel::SupportBand
+  //
+  // The cells of the matrix of ComputeAlignment() in a band that
+  // covers the nonzero cells of a posterior matrix.  Row i spans
+  // columns lo[i] to hi[i], where hi[i] is the last nonzero column
+  // of rows 1 to i and lo[i] the first nonzero column of rows i to
+  // seq1Length, so neither bound ever decreases.  A cell outside
+  // the band then has no posterior, and its value follows from the
+  // band: left of the band, it is that of the cell above, and right
+  // of the band, that of the last cell of the band in its row.
+  /////////////////////////////////////////////////////////////////
+
+  struct SupportBand {
+    VI lo, hi;                         // columns of the band in each row
+    SafeVector<size_t> offsets;        // first cell of each row in values
+    float *values;                     // cells of the band
+    float *rowEnds;                    // cell (i, hi[i]) of each row
+
+    SupportBand (const ProfilePosterior &posterior) :
+      lo (posterior.GetSeq1Length() + 1), hi (posterior.GetSeq1Length() + 1),
+      offsets (posterior.GetSeq1Length() + 2, 0), values (NULL), rowEnds (NULL) {
+      const int seq1Length = posterior.GetSeq1Length();
+      const int seq2Length = posterior.GetSeq2Length();
+      int first, last;
+
+      // column 0 and row 0 are never filled
+      lo[0] = 1; hi[0] = 0;
+      for (int i = 1; i <= seq1Length; i++){
+        posterior.GetSupport (i, first, last);
+        hi[i] = max (hi[i-1], last);
+      }
+      int nextLo = seq2Length + 1;
+      for (int i = seq1Length; i >= 1; i--){
+        posterior.GetSupport (i, first, last);
+        lo[i] = nextLo = max (min (nextLo, first), 1);
+      }
+      for (int i = 1; i <= seq1Length; i++)
+        offsets[i+1] = offsets[i] + max (hi[i] - lo[i] + 1, 0);
+    }
+
+    size_t GetNumCells () const {
+      return offsets.back();
+    }
+
+    // Returns cell (i, j) once the band has been filled.
+    float GetCell (int i, int j) const {
+      if (j < lo[i])
+        i = upper_bound (lo.begin() + 1, lo.begin() + i, j) - lo.begin() - 1;
+      if (i == 0 || j == 0)
+        return 0;
+      if (j > hi[i])
+        return rowEnds[i];
+      return values[offsets[i] + j - lo[i]];
+    }
+  };
+
+  /////////////////////////////////////////////////////////////////
+  // ProbabilisticModel::AlignSupport()
+  //
+  // Computes the alignment of ComputeAlignment() filling only the
+  // cells of the support band of the posterior matrix.  Instead of
+  // keeping a traceback, the choice made at each cell of the path
+  // is made again from the cells of the band, with the same
+  // operations, so the result is the same as when filling every
+  // cell.  The cells of the band are taken from the scratch arena
+  // of the thread, and only valid until the alignment returns.
+  /////////////////////////////////////////////////////////////////
+
+  pair<SafeVector<char> *, float> AlignSupport (const ProfilePosterior &posterior,
+                                                SupportBand &band) const {
+    const int seq1Length = posterior.GetSeq1Length();
+    const int seq2Length = posterior.GetSeq2Length();
+
+    ScratchArena &arena = ScratchArena::GetThreadArena();
+    ScratchScope scope (arena);
+
+    band.values = arena.Allocate<float> (band.GetNumCells());
+    band.rowEnds = arena.AllocateZeros<float> (seq1Length + 1);
+
+    // holds row i-1, then row i, up to column hi[i]
+    float *row = arena.AllocateZeros<float> (seq2Length + 1);
+    float *buffer = arena.Allocate<float> (seq2Length + 1);
+    char choice;
+
+    // fill in matrix
+    for (int i = 1; i <= seq1Length; i++){
+      const int lo = band.lo[i], hi = band.hi[i];
+
+      // cells right of the band in row i-1
+      for (int j = band.hi[i-1] + 1; j <= hi; j++)
+        row[j] = row[band.hi[i-1]];
+
+      if (lo <= hi){
+        const float *post = posterior.GetRow (i, buffer);
+        float *cells = band.values + band.offsets[i] - lo;
+        float diag = row[lo-1];
+        float left = diag;
+        for (int j = lo; j <= hi; j++){
+          const float up = row[j];
+          ChooseBestOfThree (post[j] + diag, left, up, 'D', 'L', 'U', &left, &choice);
+          diag = up;
+          row[j] = cells[j] = left;
+        }
+      }
+      band.rowEnds[i] = row[hi];
+    }
+
+    // store best score
+    float total = band.GetCell (seq1Length, seq2Length);
+
+    // compute traceback
+    SafeVector<char> *alignment = new SafeVector<char>; assert (alignment);
+    int r = seq1Length, c = seq2Length;
+    float best;
+    while (r != 0 || c != 0){
+      if (r == 0){ c--; alignment->push_back ('Y'); continue; }
+      if (c == 0){ r--; alignment->push_back ('X'); continue; }
+      ChooseBestOfThree (posterior.GetValue (r, c) + band.GetCell (r-1, c-1),
+                         band.GetCell (r, c-1), band.GetCell (r-1, c),
+                         'D', 'L', 'U', &best, &choice);
+      switch (choice){
+      case 'L': c--; alignment->push_back ('Y'); break;
+      case 'U': r--; alignment->push_back ('X'); break;
+      case 'D': c--; r--; alignment->push_back ('B'); break;
+      }
+    }
+
+    reverse (alignment->begin(), alignment->end());
+
+    return make_pair(alignment, total);
+  }
 
   /////////////////////////////////////////////////////////////////
   // ProbabilisticModel::ComputeAlignmentWithGapPenalties()
@@ -1186,118 +1683,150 @@ gapExtend[1]:central extend gap probability
   //
   /////////////////////////////////////////////////////////////////
 
-
-#ifdef _OPENMP
-  struct SeqsPair {
-     int seq1;
-     int seq2;
-   };
-#endif
-
-  VF *BuildPosterior (MultiSequence *align1, MultiSequence *align2,
-                      const SafeVector<SafeVector<SparseMatrix *> > &sparseMatrices,
-		      float cutoff = 0.0f) const {
-    const int seq1Length = align1->GetSequence(0)->GetLength();
-    const int seq2Length = align2->GetSequence(0)->GetLength();
-
-    VF *posteriorPtr = new VF((seq1Length+1) * (seq2Length+1), 0); assert (posteriorPtr);
-    VF &posterior = *posteriorPtr;
-    VF::iterator postPtr = posterior.begin();
-    
-  #ifdef _OPENMP
-    //calculate sequence pairs for openmp model
-    int pairIdx = 0;
-    int numPairs = align1->GetNumSequences() * align2->GetNumSequences();
-    SeqsPair* seqsPairs = new SeqsPair[numPairs];
-    for(int a = 0; a < align1->GetNumSequences(); a++) {
-      for(int b = 0; b < align2->GetNumSequences(); b++) {
-        seqsPairs[pairIdx].seq1 = a;
-        seqsPairs[pairIdx].seq2 = b;
-        pairIdx++;
-      }
-    } 
-  #endif  
-
-  // do all pairwise
-  #ifdef _OPENMP
-  #pragma omp parallel for private(pairIdx) default(shared) schedule(dynamic)
-    for(pairIdx = 0; pairIdx < numPairs; pairIdx++) {
-      int i = seqsPairs[pairIdx].seq1;
-      int j = seqsPairs[pairIdx].seq2;
-
-  #else
-    for ( int i = 0; i < align1->GetNumSequences(); i++ ) {
-      for ( int j = 0; j < align2->GetNumSequences(); j++ ) {
-  #endif
-
-        // for each s in align1
-        int first = align1->GetSequence(i)->GetLabel();
-        SafeVector<int> *mapping1 = align1->GetSequence(i)->GetMapping();
-        // for each t in align2
-        int second = align2->GetSequence(j)->GetLabel();
-        SafeVector<int> *mapping2 = align2->GetSequence(j)->GetMapping();
-
-	      if (first < second){
-
-	       // get the associated sparse matrix
-	       SparseMatrix *matrix = sparseMatrices[first][second];
-	  
-	       for (int ii = 1; ii <= matrix->GetSeq1Length(); ii++){
-	         SafeVector<PIF>::iterator row = matrix->GetRowPtr(ii);
-	         int base = (*mapping1)[ii] * (seq2Length+1);
-	         int rowSize = matrix->GetRowSize(ii);
-	    
-	         // add in all relevant values
-	         for (int jj = 0; jj < rowSize; jj++)
-	           posterior[base + (*mapping2)[row[jj].first]] += row[jj].second;
-	    
-	           // subtract cutoff 
-	           for (int jj = 0; jj < matrix->GetSeq2Length(); jj++)
-	             posterior[base + (*mapping2)[jj]] -= cutoff;
-	         }
-
-	       } else {
-
-	       // get the associated sparse matrix
-	         SparseMatrix *matrix = sparseMatrices[second][first];
-	  
-	         for (int jj = 1; jj <= matrix->GetSeq1Length(); jj++){
-	           SafeVector<PIF>::iterator row = matrix->GetRowPtr(jj);
-	           int base = (*mapping2)[jj];
-	           int rowSize = matrix->GetRowSize(jj);
-	    
-	           // add in all relevant values
-	           for (int ii = 0; ii < rowSize; ii++)
-	             posterior[base + (*mapping1)[row[ii].first] * (seq2Length + 1)] += row[ii].second;
-	    
-	           // subtract cutoff 
-	           for (int ii = 0; ii < matrix->GetSeq2Length(); ii++)
-	             posterior[base + (*mapping1)[ii] * (seq2Length + 1)] -= cutoff;
-	         }
-	      }
-
-        delete mapping2;
-        delete mapping1;
-  #ifndef _OPENMP
-      }
-  #endif
-    }
-
-    return posteriorPtr;
-  }
+	VF *BuildPosterior(MultiSequence *align1, MultiSequence *align2,
+			const PairMatrixStore &sparseMatrices,
+			float cutoff = 0.0f) const {
+		VF pairWeights(align1->GetNumSequences() * align2->GetNumSequences(),
+				1.0f);
+		ProfilePosterior posterior(align1->GetSequence(0)->GetLength(),
+				align2->GetSequence(0)->GetLength(), false);
+		AccumulatePosterior(align1, align2, sparseMatrices, pairWeights,
+				cutoff, posterior);
+		return posterior.ReleaseDense();
+	}
 
 	//added by Liu Yongchao.Feb 23, 2010
 	VF *BuildPosterior(int* seqsWeights, MultiSequence *align1,
 			MultiSequence *align2,
-			const SafeVector<SafeVector<SparseMatrix *> > &sparseMatrices,
+			const PairMatrixStore &sparseMatrices,
 			float cutoff = 0.0f) const {
+		ProfilePosterior posterior(align1->GetSequence(0)->GetLength(),
+				align2->GetSequence(0)->GetLength(), false);
+		AccumulatePosterior(align1, align2, sparseMatrices,
+				GetPairWeights(seqsWeights, align1, align2), cutoff, posterior);
+		return posterior.ReleaseDense();
+	}
+
+	/////////////////////////////////////////////////////////////////
+	// ProbabilisticModel::BuildProfilePosterior()
+	//
+	// Same as BuildPosterior(), weighted by seqsWeights unless it is
+	// NULL.  When no cutoff is subtracted and the dense matrix would
+	// have more than LINEAR_SPACE_CELLS cells, the matrix is kept
+	// sparse, and ComputeAlignment() aligns it in linear space.  If
+	// maxPairs is positive and the alignments have more sequence
+	// pairs, the matrix is estimated from at most maxPairs of them,
+	// as chosen by SamplePairs().  The cells of a dense matrix are
+	// taken from arena unless it is NULL.
+	/////////////////////////////////////////////////////////////////
+
+	ProfilePosterior *BuildProfilePosterior(int *seqsWeights,
+			MultiSequence *align1, MultiSequence *align2,
+			const PairMatrixStore &sparseMatrices,
+			float cutoff = 0.0f, int maxPairs = 0,
+			ScratchArena *arena = NULL) const {
+		const int seq1Length = align1->GetSequence(0)->GetLength();
+		const int seq2Length = align2->GetSequence(0)->GetLength();
+
+		bool sparse = false;
+#ifdef __SSE2__
+		sparse = cutoff == 0
+				&& (double) (seq1Length + 1) * (seq2Length + 1)
+						> LINEAR_SPACE_CELLS;
+#endif
+		ProfilePosterior *posterior = new ProfilePosterior(seq1Length,
+				seq2Length, sparse, arena);
+		assert(posterior);
+
+		VF pairWeights = seqsWeights ?
+				GetPairWeights(seqsWeights, align1, align2) :
+				VF(align1->GetNumSequences() * align2->GetNumSequences(),
+						1.0f);
+		if (maxPairs > 0 && (int) pairWeights.size() > maxPairs)
+			SamplePairs(pairWeights, maxPairs);
+		AccumulatePosterior(align1, align2, sparseMatrices, pairWeights,
+				cutoff, *posterior);
+		return posterior;
+	}
+
+	/////////////////////////////////////////////////////////////////
+	// ProbabilisticModel::BuildAggregatedPosterior()
+	//
+	// Same as BuildProfilePosterior() with seqsWeights and no cutoff,
+	// but summing the aggregate of one profile against the sequences
+	// of the other instead of all sequence pairs.  At least one of
+	// the profiles must have an aggregate; the one with fewer cells
+	// against the other profile is used.
+	/////////////////////////////////////////////////////////////////
+
+	ProfilePosterior *BuildAggregatedPosterior(int *seqsWeights,
+			MultiSequence *align1, const ProfileAggregate *aggregate1,
+			MultiSequence *align2, const ProfileAggregate *aggregate2,
+			const PairMatrixStore &sparseMatrices,
+			ScratchArena *arena = NULL) const {
+		assert(aggregate1 || aggregate2);
 		const int seq1Length = align1->GetSequence(0)->GetLength();
 		const int seq2Length = align2->GetSequence(0)->GetLength();
+		const int numSeqs1 = align1->GetNumSequences();
+		const int numSeqs2 = align2->GetNumSequences();
 
-		VF *posteriorPtr = new VF((seq1Length + 1) * (seq2Length + 1), 0);
-		assert(posteriorPtr);
-		VF &posterior = *posteriorPtr;
-		VF::iterator postPtr = posterior.begin();
+		bool sparse = false;
+#ifdef __SSE2__
+		sparse = (double) (seq1Length + 1) * (seq2Length + 1)
+				> LINEAR_SPACE_CELLS;
+#endif
+		ProfilePosterior *posterior = new ProfilePosterior(seq1Length,
+				seq2Length, sparse, arena);
+		assert(posterior);
+
+		float totalWeights = 0;
+		for (int i = 0; i < numSeqs1; i++)
+			for (int j = 0; j < numSeqs2; j++)
+				totalWeights += seqsWeights[align1->GetSequence(i)->GetLabel()]
+						* seqsWeights[align2->GetSequence(j)->GetLabel()];
+
+		size_t numCells1 = 0, numCells2 = 0;
+		if (aggregate1)
+			for (int j = 0; j < numSeqs2; j++)
+				numCells1 += aggregate1->GetNumCells(
+						align2->GetSequence(j)->GetLabel());
+		if (aggregate2)
+			for (int i = 0; i < numSeqs1; i++)
+				numCells2 += aggregate2->GetNumCells(
+						align1->GetSequence(i)->GetLabel());
+
+		if (aggregate1 && (!aggregate2 || numCells1 <= numCells2))
+			for (int j = 0; j < numSeqs2; j++) {
+				const int label = align2->GetSequence(j)->GetLabel();
+				ProfileAggregate::AddSum(aggregate1, align1, label,
+						sparseMatrices, seqsWeights, NULL,
+						align2->GetMapping(j), false,
+						seqsWeights[label] / totalWeights, *posterior);
+			}
+		else
+			for (int i = 0; i < numSeqs1; i++) {
+				const int label = align1->GetSequence(i)->GetLabel();
+				ProfileAggregate::AddSum(aggregate2, align2, label,
+						sparseMatrices, seqsWeights, NULL,
+						align1->GetMapping(i), true,
+						seqsWeights[label] / totalWeights, *posterior);
+			}
+
+		posterior->Finish();
+		return posterior;
+	}
+
+private:
+
+	/////////////////////////////////////////////////////////////////
+	// ProbabilisticModel::GetPairWeights()
+	//
+	// Returns the weight of each sequence pair of two alignments, the
+	// product of the weights of its sequences normalized to sum to 1.
+	/////////////////////////////////////////////////////////////////
+
+	static VF GetPairWeights(int *seqsWeights, MultiSequence *align1,
+			MultiSequence *align2) {
 
 		//compute the total sum of all weights
 		float totalWeights = 0;
@@ -1311,71 +1840,275 @@ gapExtend[1]:central extend gap probability
 				totalWeights += w1 * w2;
 			}
 		}
-		// for each s in align1
+		VF pairWeights;
 		for (int i = 0; i < align1->GetNumSequences(); i++) {
-			int first = align1->GetSequence(i)->GetLabel();
-			int w1 = seqsWeights[first];
-			SafeVector<int> *mapping1 = align1->GetSequence(i)->GetMapping();
-			// for each t in align2
+			int w1 = seqsWeights[align1->GetSequence(i)->GetLabel()];
 			for (int j = 0; j < align2->GetNumSequences(); j++) {
-				int second = align2->GetSequence(j)->GetLabel();
-				int w2 = seqsWeights[second];
-				SafeVector<int> *mapping2 =
-						align2->GetSequence(j)->GetMapping();
-
-				float w = (float) (w1 * w2) / totalWeights;
-				if (first < second) {
-
-					// get the associated sparse matrix
-					SparseMatrix *matrix = sparseMatrices[first][second];
+				int w2 = seqsWeights[align2->GetSequence(j)->GetLabel()];
+				pairWeights.push_back((float) (w1 * w2) / totalWeights);
+			}
+		}
+		return pairWeights;
+	}
 
-					for (int ii = 1; ii <= matrix->GetSeq1Length(); ii++) {
-						SafeVector<PIF>::iterator row = matrix->GetRowPtr(ii);
-						int base = (*mapping1)[ii] * (seq2Length + 1);
-						int rowSize = matrix->GetRowSize(ii);
+	/////////////////////////////////////////////////////////////////
+	// ProbabilisticModel::SamplePairs()
+	//
+	// Keeps the weights of at most maxPairs sequence pairs, drawn by
+	// systematic sampling: the pairs are laid out in order along an
+	// interval of their total weight, cut into maxPairs strata of
+	// equal weight, and the pair at the middle of each stratum is
+	// drawn.  A pair drawn h times gets h times the weight of a
+	// stratum and the others get 0, so every pair keeps its weight
+	// on average, and the pairs of every sequence are drawn in
+	// proportion to its weight.  The draw is deterministic.
+	/////////////////////////////////////////////////////////////////
+
+	static void SamplePairs(VF &pairWeights, int maxPairs) {
+		double totalWeight = 0;
+		for (int k = 0; k < (int) pairWeights.size(); k++)
+			totalWeight += pairWeights[k];
+		if (totalWeight <= 0)
+			return;
+
+		const double stratum = totalWeight / maxPairs;
+		double next = stratum / 2, end = 0;
+		for (int k = 0; k < (int) pairWeights.size(); k++) {
+			end += pairWeights[k];
+			int draws = 0;
+			for (; next < end; next += stratum)
+				draws++;
+			pairWeights[k] = (float) (draws * stratum);
+		}
+	}
 
-						// add in all relevant values
-						for (int jj = 0; jj < rowSize; jj++)
-							posterior[base + (*mapping2)[row[jj].first]] += w
-									* row[jj].second;
+	/////////////////////////////////////////////////////////////////
+	// ProbabilisticModel::TransposedRows
+	//
+	// The cells of a matrix stored transposed, regrouped by the rows
+	// of the view, so that any block of its rows can be reached
+	// directly.
+	/////////////////////////////////////////////////////////////////
+
+	struct TransposedRows {
+		VI starts;                     // first cell of each view row
+		VI columns;                    // view column of each cell
+		VF values;                     // value of each cell
+
+		void Fill(const SparseMatrix &matrix) {
+			const int numRows = matrix.GetSeq2Length();
+			starts.assign(numRows + 2, 0);
+			for (int jj = 1; jj <= matrix.GetSeq1Length(); jj++) {
+				const unsigned char *cols = matrix.GetColumnPtr(jj);
+				const int rowSize = matrix.GetRowSize(jj);
+				for (int c = 0, ii = 0; c < rowSize; c++) {
+					ii += cols[c];
+					starts[ii + 1]++;
+				}
+			}
+			for (int ii = 1; ii <= numRows + 1; ii++)
+				starts[ii] += starts[ii - 1];
+			columns.resize(starts[numRows + 1]);
+			values.resize(starts[numRows + 1]);
+			VI next(starts);
+			for (int jj = 1; jj <= matrix.GetSeq1Length(); jj++) {
+				const unsigned char *cols = matrix.GetColumnPtr(jj);
+				const float *vals = matrix.GetValuePtr(jj);
+				const int rowSize = matrix.GetRowSize(jj);
+				for (int c = 0, ii = 0; c < rowSize; c++) {
+					ii += cols[c];
+					columns[next[ii]] = jj;
+					values[next[ii]++] = vals[c];
+				}
+			}
+		}
+	};
+
+	/////////////////////////////////////////////////////////////////
+	// ProbabilisticModel::AddPair()
+	//
+	// Adds the weighted posterior matrix of one sequence pair to the
+	// rows [rowBegin, rowEnd) of the profile posterior.  A matrix
+	// stored transposed is read from rows when given and scattered
+	// by columns otherwise, which is only possible when all rows are
+	// updated.
+	/////////////////////////////////////////////////////////////////
+
+	static void AddPair(const PairMatrixView &view,
+			const TransposedRows *rows, const int *mapping1,
+			const int *mapping2, float w, float cutoff, int rowBegin,
+			int rowEnd, ProfilePosterior &posterior) {
+		const SparseMatrix &matrix = view.GetMatrix();
+		const int length1 = view.GetSeq1Length();
+		const int length2 = view.GetSeq2Length();
+
+		// the residues of the first sequence in the rows to update
+		const int iiBegin = lower_bound(mapping1, mapping1 + length1 + 1,
+				rowBegin) - mapping1;
+		const int iiEnd = lower_bound(mapping1, mapping1 + length1 + 1,
+				rowEnd) - mapping1;
+
+		if (!view.IsTransposed()) {
+			for (int ii = max(iiBegin, 1); ii < iiEnd; ii++) {
+				const unsigned char *columns = matrix.GetColumnPtr(ii);
+				const float *values = matrix.GetValuePtr(ii);
+				const int rowSize = matrix.GetRowSize(ii);
+				const int row = mapping1[ii];
+
+				// add in all relevant values
+				for (int c = 0, jj = 0; c < rowSize; c++) {
+					jj += columns[c];
+					posterior.Add(row, mapping2[jj], w * values[c]);
+				}
 
-						// subtract cutoff 
-						for (int jj = 0; jj < matrix->GetSeq2Length(); jj++)
-							posterior[base + (*mapping2)[jj]] -= w * cutoff;
-					}
+				// subtract cutoff
+				if (cutoff != 0)
+					for (int jj = 0; jj < length2; jj++)
+						posterior.Add(row, mapping2[jj], -(w * cutoff));
+			}
+			return;
+		}
 
-				} else {
+		if (rows) {
+			for (int ii = max(iiBegin, 1); ii < iiEnd; ii++) {
+				const int row = mapping1[ii];
+				for (int c = rows->starts[ii]; c < rows->starts[ii + 1]; c++)
+					posterior.Add(row, mapping2[rows->columns[c]],
+							w * rows->values[c]);
+			}
+		} else {
+			assert(iiBegin == 0 && iiEnd == length1 + 1);
+			for (int jj = 1; jj <= length2; jj++) {
+				const unsigned char *columns = matrix.GetColumnPtr(jj);
+				const float *values = matrix.GetValuePtr(jj);
+				const int rowSize = matrix.GetRowSize(jj);
+				const int col = mapping2[jj];
+
+				// add in all relevant values
+				for (int c = 0, ii = 0; c < rowSize; c++) {
+					ii += columns[c];
+					posterior.Add(mapping1[ii], col, w * values[c]);
+				}
+			}
+		}
 
-					// get the associated sparse matrix
-					SparseMatrix *matrix = sparseMatrices[second][first];
+		// subtract cutoff
+		if (cutoff != 0)
+			for (int ii = iiBegin; ii < min(iiEnd, length1); ii++) {
+				const int row = mapping1[ii];
+				for (int jj = 1; jj <= length2; jj++)
+					posterior.Add(row, mapping2[jj], -(w * cutoff));
+			}
+	}
 
-					for (int jj = 1; jj <= matrix->GetSeq1Length(); jj++) {
-						SafeVector<PIF>::iterator row = matrix->GetRowPtr(jj);
-						int base = (*mapping2)[jj];
-						int rowSize = matrix->GetRowSize(jj);
+	/////////////////////////////////////////////////////////////////
+	// ProbabilisticModel::AccumulatePosterior()
+	//
+	// Builds the profile posterior of two alignments from the
+	// posterior matrices of all their sequence pairs, each scaled by
+	// its weight.  Every cell receives the contributions of the pairs
+	// in the same order as in a serial loop over them, so the result
+	// does not depend on the number of threads: in parallel, the
+	// pairs are taken in batches, and every thread owns a block of
+	// rows of the posterior and adds the whole batch to its rows
+	// only, after the matrices stored transposed have been regrouped
+	// by rows.
+	/////////////////////////////////////////////////////////////////
+
+	void AccumulatePosterior(MultiSequence *align1, MultiSequence *align2,
+			const PairMatrixStore &sparseMatrices, const VF &pairWeights,
+			float cutoff, ProfilePosterior &posterior) const {
+		const int seq1Length = align1->GetSequence(0)->GetLength();
+		const int seq2Length = align2->GetSequence(0)->GetLength();
+		const int numSeqs1 = align1->GetNumSequences();
+		const int numSeqs2 = align2->GetNumSequences();
+
+		// pairs of zero weight add nothing
+		VI pairs;
+		for (int pairIdx = 0; pairIdx < numSeqs1 * numSeqs2; pairIdx++)
+			if (pairWeights[pairIdx] != 0)
+				pairs.push_back(pairIdx);
+		const int numPairs = pairs.size();
+
+		// fill the mapping caches before any thread reads them
+		SafeVector<const int *> mappings1(numSeqs1), mappings2(numSeqs2);
+		for (int i = 0; i < numSeqs1; i++)
+			mappings1[i] = align1->GetMapping(i);
+		for (int j = 0; j < numSeqs2; j++)
+			mappings2[j] = align2->GetMapping(j);
 
-						// add in all relevant values
-						for (int ii = 0; ii < rowSize; ii++)
-							posterior[base
-									+ (*mapping1)[row[ii].first]
-											* (seq2Length + 1)] += w
-									* row[ii].second;
+#ifdef _OPENMP
+		const int numThreads = omp_in_parallel() ? 1 : omp_get_max_threads();
+#else
+		const int numThreads = 1;
+#endif
+		if (numThreads == 1
+				|| (double) numPairs * (seq1Length + seq2Length)
+						< PARALLEL_POSTERIOR_WORK) {
+			for (int k = 0; k < numPairs; k++) {
+				const int pairIdx = pairs[k];
+				const int i = pairIdx / numSeqs2;
+				const int j = pairIdx % numSeqs2;
+				PairMatrixView view = sparseMatrices.GetView(
+						align1->GetSequence(i)->GetLabel(),
+						align2->GetSequence(j)->GetLabel());
+				AddPair(view, NULL, mappings1[i], mappings2[j],
+						pairWeights[pairIdx], cutoff, 0, seq1Length + 1,
+						posterior);
+			}
+		}
+#ifdef _OPENMP
+		else {
+			const int batchSize = POSTERIOR_BATCH_PER_THREAD * numThreads;
+			SafeVector<PairMatrixView *> views(batchSize);
+			SafeVector<TransposedRows> rows(batchSize);
+
+#pragma omp parallel num_threads(numThreads) default(shared)
+			{
+				// the block of posterior rows of this thread
+				const int tid = omp_get_thread_num();
+				const int rowBegin = (long long) (seq1Length + 1) * tid
+						/ numThreads;
+				const int rowEnd = (long long) (seq1Length + 1) * (tid + 1)
+						/ numThreads;
+
+				for (int batch = 0; batch < numPairs; batch += batchSize) {
+					const int batchEnd = min(batch + batchSize, numPairs);
+
+					// fetch the matrices and regroup the transposed ones
+#pragma omp for schedule(dynamic)
+					for (int k = batch; k < batchEnd; k++) {
+						const int i = pairs[k] / numSeqs2;
+						const int j = pairs[k] % numSeqs2;
+						PairMatrixView *view = new PairMatrixView(
+								sparseMatrices.GetView(
+										align1->GetSequence(i)->GetLabel(),
+										align2->GetSequence(j)->GetLabel()));
+						if (view->IsTransposed())
+							rows[k - batch].Fill(view->GetMatrix());
+						views[k - batch] = view;
+					}
 
-						// subtract cutoff 
-						for (int ii = 0; ii < matrix->GetSeq2Length(); ii++)
-							posterior[base + (*mapping1)[ii] * (seq2Length + 1)] -=
-									w * cutoff;
+					for (int k = batch; k < batchEnd; k++) {
+						const int pairIdx = pairs[k];
+						const int i = pairIdx / numSeqs2;
+						const int j = pairIdx % numSeqs2;
+						AddPair(*views[k - batch], &rows[k - batch],
+								mappings1[i], mappings2[j],
+								pairWeights[pairIdx], cutoff, rowBegin, rowEnd,
+								posterior);
 					}
+#pragma omp barrier
 
+#pragma omp for
+					for (int k = batch; k < batchEnd; k++)
+						delete views[k - batch];
 				}
-
-				delete mapping2;
 			}
-
-			delete mapping1;
 		}
+#endif
 
-		return posteriorPtr;
+		posterior.Finish();
 	}
 };
 
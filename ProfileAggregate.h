@@ -0,0 +1,190 @@
+/////////////////////////////////////////////////////////////////
+// ProfileAggregate.h
+//
+// Sums of the pair posteriors of a profile against every sequence
+// outside it, kept up the guide tree.
+/////////////////////////////////////////////////////////////////
+
+#ifndef PROFILEAGGREGATE_H
+#define PROFILEAGGREGATE_H
+
+#include <cassert>
+#include "SafeVector.h"
+#include "MultiSequence.h"
+#include "PairMatrixStore.h"
+#include "ProfilePosterior.h"
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+using namespace std;
+
+/////////////////////////////////////////////////////////////////
+// ProfileAggregate
+//
+// For a profile built from the alignment of a subtree, holds
+// against every sequence u outside the subtree the sparse matrix
+// of (columns of the profile) x (positions of u) of
+//    sum over s in the profile of  w(s) P(s[i'] <--> u[j'])
+// where column i of the profile holds position i' of s.  The
+// profile posterior of two profiles then follows from the
+// aggregate of either one and the sequences of the other, and the
+// aggregate of their alignment from remapping the rows of both
+// aggregates through the new columns, so a merge costs time in
+// the number of columns rather than in the number of sequence
+// pairs.  A profile of a single sequence has no aggregate; its
+// matrices are read from the pair store.
+/////////////////////////////////////////////////////////////////
+
+class ProfileAggregate {
+
+	SafeVector<ProfilePosterior *> sums;   // by label of the other sequence
+
+	ProfileAggregate(const ProfileAggregate &);
+	ProfileAggregate &operator=(const ProfileAggregate &);
+
+	static void Put(ProfilePosterior &target, const int *rowMap,
+			const int *colMap, bool transpose, int row, int col,
+			float value) {
+		if (rowMap)
+			row = rowMap[row];
+		if (colMap)
+			col = colMap[col];
+		if (transpose)
+			target.Add(col, row, value);
+		else
+			target.Add(row, col, value);
+	}
+
+public:
+
+	ProfileAggregate(int numSeqs) :
+			sums(numSeqs, (ProfilePosterior *) NULL) {
+	}
+
+	~ProfileAggregate() {
+		for (int i = 0; i < (int) sums.size(); i++)
+			delete sums[i];
+	}
+
+	/////////////////////////////////////////////////////////////////
+	// ProfileAggregate::GetNumCells()
+	//
+	// Returns the number of cells of the sum against sequence label.
+	/////////////////////////////////////////////////////////////////
+
+	size_t GetNumCells(int label) const {
+		assert(sums[label]);
+		return sums[label]->GetNumCells();
+	}
+
+	/////////////////////////////////////////////////////////////////
+	// ProfileAggregate::AddSum()
+	//
+	// Adds scale times the sum of profile align against sequence
+	// label to target, taking it from aggregate, or from the pair
+	// store if the profile has a single sequence and aggregate is
+	// NULL.  Rows (profile columns) and columns (positions of label)
+	// are renumbered through rowMap and colMap unless they are NULL,
+	// and swapped if transpose is set.
+	/////////////////////////////////////////////////////////////////
+
+	static void AddSum(const ProfileAggregate *aggregate,
+			MultiSequence *align, int label,
+			const PairMatrixStore &sparseMatrices, const int *seqsWeights,
+			const int *rowMap, const int *colMap, bool transpose,
+			float scale, ProfilePosterior &target) {
+		if (aggregate) {
+			const ProfilePosterior *sum = aggregate->sums[label];
+			assert(sum);
+			for (int row = 1; row <= sum->GetSeq1Length(); row++) {
+				const SafeVector<pair<int, float> > &cells = sum->GetCells(row);
+				for (int c = 0; c < (int) cells.size(); c++)
+					Put(target, rowMap, colMap, transpose, row,
+							cells[c].first, scale * cells[c].second);
+			}
+			return;
+		}
+
+		assert(align->GetNumSequences() == 1);
+		const int first = align->GetSequence(0)->GetLabel();
+		const int *mapping = align->GetMapping(0);
+		scale *= seqsWeights[first];
+
+		PairMatrixView view = sparseMatrices.GetView(first, label);
+		const SparseMatrix &matrix = view.GetMatrix();
+		for (int i = 1; i <= matrix.GetSeq1Length(); i++) {
+			const unsigned char *columns = matrix.GetColumnPtr(i);
+			const float *values = matrix.GetValuePtr(i);
+			const int rowSize = matrix.GetRowSize(i);
+			for (int c = 0, j = 0; c < rowSize; c++) {
+				j += columns[c];
+				if (view.IsTransposed())
+					Put(target, rowMap, colMap, transpose, mapping[j], i,
+							scale * values[c]);
+				else
+					Put(target, rowMap, colMap, transpose, mapping[i], j,
+							scale * values[c]);
+			}
+		}
+	}
+
+	/////////////////////////////////////////////////////////////////
+	// ProfileAggregate::Merge()
+	//
+	// Returns the aggregate of the alignment of profiles align1 and
+	// align2, given as a string of 'X', 'Y' and 'B' as returned by
+	// ProbabilisticModel::ComputeAlignment(), or NULL if no sequence
+	// is left outside it.
+	/////////////////////////////////////////////////////////////////
+
+	static ProfileAggregate *Merge(MultiSequence *align1,
+			const ProfileAggregate *aggregate1, MultiSequence *align2,
+			const ProfileAggregate *aggregate2,
+			const SafeVector<char> &alignment,
+			const PairMatrixStore &sparseMatrices, const int *seqsWeights) {
+		const int numSeqs = sparseMatrices.GetNumSequences();
+
+		SafeVector<bool> inside(numSeqs, false);
+		for (int i = 0; i < align1->GetNumSequences(); i++)
+			inside[align1->GetSequence(i)->GetLabel()] = true;
+		for (int i = 0; i < align2->GetNumSequences(); i++)
+			inside[align2->GetSequence(i)->GetLabel()] = true;
+		VI outside;
+		for (int u = 0; u < numSeqs; u++)
+			if (!inside[u])
+				outside.push_back(u);
+		if (outside.empty())
+			return NULL;
+
+		// the columns of the alignment that hold those of each profile
+		VI columns1(1, 0), columns2(1, 0);
+		for (int k = 0; k < (int) alignment.size(); k++) {
+			if (alignment[k] != 'Y')
+				columns1.push_back(k + 1);
+			if (alignment[k] != 'X')
+				columns2.push_back(k + 1);
+		}
+
+		ProfileAggregate *merged = new ProfileAggregate(numSeqs);
+		assert(merged);
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic) if (!omp_in_parallel())
+#endif
+		for (int k = 0; k < (int) outside.size(); k++) {
+			const int u = outside[k];
+			ProfilePosterior *sum = new ProfilePosterior(alignment.size(),
+					sparseMatrices.GetSeqLength(u), true);
+			AddSum(aggregate1, align1, u, sparseMatrices, seqsWeights,
+					&columns1[0], NULL, false, 1.0f, *sum);
+			AddSum(aggregate2, align2, u, sparseMatrices, seqsWeights,
+					&columns2[0], NULL, false, 1.0f, *sum);
+			sum->Finish();
+			merged->sums[u] = sum;
+		}
+		return merged;
+	}
+};
+
+#endif
@@ -0,0 +1,284 @@
+/////////////////////////////////////////////////////////////////
+// ProfilePosterior.h
+//
+// Posterior matrix of two alignments, held densely or by rows.
+/////////////////////////////////////////////////////////////////
+
+#ifndef PROFILEPOSTERIOR_H
+#define PROFILEPOSTERIOR_H
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include "SafeVector.h"
+#include "ScratchArena.h"
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+using namespace std;
+
+/////////////////////////////////////////////////////////////////
+// ProfilePosterior
+//
+// The matrix built by ProbabilisticModel::BuildPosterior() to align
+// two alignments, of (seq1Length+1) x (seq2Length+1) cells.  A dense
+// matrix stores every cell.  A sparse one stores, for each row, only
+// the cells that received a nonzero contribution, so that wide
+// alignments do not need a full matrix.  Contributions to a cell are
+// summed in the order they are added in either case, so both give
+// the same values.  The first and last columns that received a
+// contribution are kept for every row, as the support of the row.
+//
+// A sparse row collects contributions unsorted at its end and
+// merges them into its sorted front once they outnumber it, so each
+// contribution is moved a constant number of times on average.
+// Different threads may add to different rows at the same time.
+//
+// The cells of a dense matrix may be taken from a scratch arena,
+// in which case they belong to the arena and are released with the
+// other temporaries of the merge, after the matrix is deleted.
+/////////////////////////////////////////////////////////////////
+
+class ProfilePosterior {
+
+	int seq1Length, seq2Length;
+	float *dense;                                 // all cells, or NULL
+	VF *denseVector;                  // storage of dense unless in an arena
+	SafeVector<SafeVector<pair<int, float> > > rows;  // cells of each row
+	VI sortedSizes;                   // length of the sorted front of rows
+	VI firstColumns, lastColumns;           // support of each row
+
+	ProfilePosterior(const ProfilePosterior &);
+	ProfilePosterior &operator=(const ProfilePosterior &);
+
+	static bool CompareColumns(const pair<int, float> &a,
+			const pair<int, float> &b) {
+		return a.first < b.first;
+	}
+
+	/////////////////////////////////////////////////////////////////
+	// ProfilePosterior::MergeRow()
+	//
+	// Sums the unsorted contributions at the end of a row into its
+	// sorted front.  Cells that are zero are dropped, since adding to
+	// a zero gives the same as adding to a missing cell.
+	/////////////////////////////////////////////////////////////////
+
+	void MergeRow(int row) {
+		SafeVector<pair<int, float> > &cells = rows[row];
+		const int sortedSize = sortedSizes[row];
+		stable_sort(cells.begin() + sortedSize, cells.end(), CompareColumns);
+
+		SafeVector<pair<int, float> > merged;
+		merged.reserve(cells.size());
+		int a = 0, b = sortedSize;
+		while (a < sortedSize || b < (int) cells.size()) {
+			int col;
+			float value = 0;
+			if (b == (int) cells.size()
+					|| (a < sortedSize && cells[a].first <= cells[b].first)) {
+				col = cells[a].first;
+				value = cells[a++].second;
+			} else
+				col = cells[b].first;
+			while (b < (int) cells.size() && cells[b].first == col)
+				value += cells[b++].second;
+			if (value != 0)
+				merged.push_back(make_pair(col, value));
+		}
+		cells.swap(merged);
+		sortedSizes[row] = cells.size();
+	}
+
+public:
+
+	/////////////////////////////////////////////////////////////////
+	// ProfilePosterior::ProfilePosterior()
+	//
+	// Constructor.  Creates a matrix of zeros, taking the cells of a
+	// dense matrix from arena unless it is NULL.
+	/////////////////////////////////////////////////////////////////
+
+	ProfilePosterior(int seq1Length, int seq2Length, bool sparse,
+			ScratchArena *arena = NULL) :
+			seq1Length(seq1Length), seq2Length(seq2Length), dense(NULL),
+			denseVector(NULL), firstColumns(seq1Length + 1, seq2Length + 1),
+			lastColumns(seq1Length + 1, -1) {
+		const size_t numCells = (size_t) (seq1Length + 1) * (seq2Length + 1);
+		if (sparse) {
+			rows.resize(seq1Length + 1);
+			sortedSizes.resize(seq1Length + 1, 0);
+		} else if (arena)
+			dense = arena->AllocateZeros<float>(numCells);
+		else {
+			denseVector = new VF(numCells, 0);
+			assert(denseVector);
+			dense = &(*denseVector)[0];
+		}
+	}
+
+	~ProfilePosterior() {
+		delete denseVector;
+	}
+
+	bool IsSparse() const {
+		return dense == NULL;
+	}
+
+	int GetSeq1Length() const {
+		return seq1Length;
+	}
+
+	int GetSeq2Length() const {
+		return seq2Length;
+	}
+
+	/////////////////////////////////////////////////////////////////
+	// ProfilePosterior::GetDense()
+	//
+	// Returns the cells of a dense matrix, row after row.
+	/////////////////////////////////////////////////////////////////
+
+	const float *GetDense() const {
+		assert(dense);
+		return dense;
+	}
+
+	/////////////////////////////////////////////////////////////////
+	// ProfilePosterior::ReleaseDense()
+	//
+	// Hands the cells of a dense matrix that is not in an arena over
+	// to the caller.
+	/////////////////////////////////////////////////////////////////
+
+	VF *ReleaseDense() {
+		assert(denseVector);
+		VF *cells = denseVector;
+		dense = NULL;
+		denseVector = NULL;
+		return cells;
+	}
+
+	/////////////////////////////////////////////////////////////////
+	// ProfilePosterior::Add()
+	//
+	// Adds value to cell (row, col).
+	/////////////////////////////////////////////////////////////////
+
+	void Add(int row, int col, float value) {
+		if (value == 0)
+			return;
+		if (col < firstColumns[row])
+			firstColumns[row] = col;
+		if (col > lastColumns[row])
+			lastColumns[row] = col;
+		if (dense) {
+			dense[(size_t) row * (seq2Length + 1) + col] += value;
+			return;
+		}
+		SafeVector<pair<int, float> > &cells = rows[row];
+		cells.push_back(make_pair(col, value));
+		if ((int) cells.size() - sortedSizes[row] > max(sortedSizes[row], 64))
+			MergeRow(row);
+	}
+
+	/////////////////////////////////////////////////////////////////
+	// ProfilePosterior::Finish()
+	//
+	// Merges all contributions of a sparse matrix, which must be done
+	// before reading it.
+	/////////////////////////////////////////////////////////////////
+
+	void Finish() {
+		if (dense)
+			return;
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic, 64) if (!omp_in_parallel())
+#endif
+		for (int row = 0; row <= seq1Length; row++)
+			if (sortedSizes[row] < (int) rows[row].size())
+				MergeRow(row);
+	}
+
+	/////////////////////////////////////////////////////////////////
+	// ProfilePosterior::GetValue()
+	//
+	// Returns cell (row, col).
+	/////////////////////////////////////////////////////////////////
+
+	float GetValue(int row, int col) const {
+		assert(row >= 0 && row <= seq1Length && col >= 0 && col <= seq2Length);
+		if (dense)
+			return dense[(size_t) row * (seq2Length + 1) + col];
+		assert(sortedSizes[row] == (int) rows[row].size());
+		const SafeVector<pair<int, float> > &cells = rows[row];
+		SafeVector<pair<int, float> >::const_iterator cell = lower_bound(
+				cells.begin(), cells.end(), make_pair(col, 0.0f),
+				CompareColumns);
+		return (cell != cells.end() && cell->first == col) ? cell->second : 0;
+	}
+
+	/////////////////////////////////////////////////////////////////
+	// ProfilePosterior::GetSupport()
+	//
+	// Returns in first and last the columns between which all nonzero
+	// cells of a row lie, with first > last if there are none.
+	/////////////////////////////////////////////////////////////////
+
+	void GetSupport(int row, int &first, int &last) const {
+		assert(row >= 0 && row <= seq1Length);
+		first = firstColumns[row];
+		last = lastColumns[row];
+	}
+
+	/////////////////////////////////////////////////////////////////
+	// ProfilePosterior::GetCells()
+	//
+	// Returns the nonzero cells of a row of a sparse matrix, as
+	// pairs of column and value sorted by column.
+	/////////////////////////////////////////////////////////////////
+
+	const SafeVector<pair<int, float> > &GetCells(int row) const {
+		assert(!dense && row >= 0 && row <= seq1Length);
+		assert(sortedSizes[row] == (int) rows[row].size());
+		return rows[row];
+	}
+
+	/////////////////////////////////////////////////////////////////
+	// ProfilePosterior::GetNumCells()
+	//
+	// Returns the number of cells stored.
+	/////////////////////////////////////////////////////////////////
+
+	size_t GetNumCells() const {
+		if (dense)
+			return (size_t) (seq1Length + 1) * (seq2Length + 1);
+		size_t numCells = 0;
+		for (int row = 0; row <= seq1Length; row++)
+			numCells += rows[row].size();
+		return numCells;
+	}
+
+	/////////////////////////////////////////////////////////////////
+	// ProfilePosterior::GetRow()
+	//
+	// Returns the seq2Length+1 cells of a row, expanded into buffer
+	// if the matrix is sparse.
+	/////////////////////////////////////////////////////////////////
+
+	const float *GetRow(int row, float *buffer) const {
+		assert(row >= 0 && row <= seq1Length);
+		if (dense)
+			return dense + (size_t) row * (seq2Length + 1);
+		assert(sortedSizes[row] == (int) rows[row].size());
+		memset(buffer, 0, (seq2Length + 1) * sizeof(float));
+		const SafeVector<pair<int, float> > &cells = rows[row];
+		for (int c = 0; c < (int) cells.size(); c++)
+			buffer[cells[c].first] = cells[c].second;
+		return buffer;
+	}
+};
+
+#endif
@@ -0,0 +1,208 @@
+/////////////////////////////////////////////////////////////////
+// ScratchArena.h
+//
+// Per-thread stack of memory for the temporaries of a merge.
+/////////////////////////////////////////////////////////////////
+
+#ifndef SCRATCHARENA_H
+#define SCRATCHARENA_H
+
+#include <algorithm>
+#include <cassert>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include "SafeVector.h"
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+using namespace std;
+
+// alignment of every block, a cache line
+const size_t ARENA_ALIGNMENT = 64;
+
+// smallest chunk requested from the system
+const size_t ARENA_CHUNK_BYTES = (size_t) 1 << 20;
+
+// memory kept for reuse once the arena is empty
+const size_t ARENA_RETAIN_BYTES = (size_t) 1 << 26;
+
+/////////////////////////////////////////////////////////////////
+// ScratchArena
+//
+// Hands out blocks from large chunks in stack order and takes
+// them all back at once: GetMark() records the top of the stack,
+// and Release() returns every block allocated since the mark.
+// The chunks stay with the arena, so the posterior matrix and the
+// traceback of one merge reuse the memory of the previous merge
+// instead of going through the global allocator, and threads that
+// align different subtrees never share a chunk.  Each thread has
+// its own arena, given by GetThreadArena(); a block must be
+// released by the thread that allocated it.
+/////////////////////////////////////////////////////////////////
+
+class ScratchArena {
+
+	SafeVector<char *> chunks;                  // memory of the arena
+	SafeVector<size_t> sizes;                   // size of each chunk
+	int current;                                // chunk holding the top
+	size_t used;                                // bytes used in it
+
+	ScratchArena(const ScratchArena &);
+	ScratchArena &operator=(const ScratchArena &);
+
+	/////////////////////////////////////////////////////////////////
+	// ScratchArena::FreeChunks()
+	//
+	// Returns the chunks after chunk last to the system.
+	/////////////////////////////////////////////////////////////////
+
+	void FreeChunks(int last) {
+		for (int k = last + 1; k < (int) chunks.size(); k++)
+			free(chunks[k]);
+		chunks.resize(last + 1);
+		sizes.resize(last + 1);
+	}
+
+public:
+
+	// Position of the top of the stack, as returned by GetMark().
+	struct Mark {
+		int chunk;
+		size_t used;
+	};
+
+	ScratchArena() :
+			current(-1), used(0) {
+	}
+
+	~ScratchArena() {
+		FreeChunks(-1);
+	}
+
+	/////////////////////////////////////////////////////////////////
+	// ScratchArena::Allocate()
+	//
+	// Returns an uninitialized block of count objects of type T,
+	// aligned on ARENA_ALIGNMENT bytes.
+	/////////////////////////////////////////////////////////////////
+
+	template<class T>
+	T *Allocate(size_t count) {
+		const size_t bytes = (max(count * sizeof(T), (size_t) 1)
+				+ ARENA_ALIGNMENT - 1) / ARENA_ALIGNMENT * ARENA_ALIGNMENT;
+		if (current < 0 || used + bytes > sizes[current]) {
+
+			// the chunks above the top are free
+			if (current + 1 < (int) chunks.size()
+					&& sizes[current + 1] < bytes)
+				FreeChunks(current);
+			if (current + 1 == (int) chunks.size()) {
+				const size_t size = max(bytes,
+						max(ARENA_CHUNK_BYTES, 2 * (current < 0 ? 0 : sizes[current])));
+				void *chunk;
+				if (posix_memalign(&chunk, ARENA_ALIGNMENT, size) != 0) {
+					cerr << "ERROR: Scratch memory allocation failed" << endl;
+					exit(1);
+				}
+				chunks.push_back((char *) chunk);
+				sizes.push_back(size);
+			}
+			current++;
+			used = 0;
+		}
+		T *block = (T *) (chunks[current] + used);
+		used += bytes;
+		return block;
+	}
+
+	/////////////////////////////////////////////////////////////////
+	// ScratchArena::AllocateZeros()
+	//
+	// Same as Allocate() with every byte of the block set to zero.
+	/////////////////////////////////////////////////////////////////
+
+	template<class T>
+	T *AllocateZeros(size_t count) {
+		T *block = Allocate<T>(count);
+		memset(block, 0, count * sizeof(T));
+		return block;
+	}
+
+	/////////////////////////////////////////////////////////////////
+	// ScratchArena::GetMark()
+	//
+	// Returns the current top of the stack.
+	/////////////////////////////////////////////////////////////////
+
+	Mark GetMark() const {
+		Mark mark = { current, used };
+		return mark;
+	}
+
+	/////////////////////////////////////////////////////////////////
+	// ScratchArena::Release()
+	//
+	// Takes back every block allocated since mark was taken.  Once
+	// the arena is empty, it keeps at most ARENA_RETAIN_BYTES.
+	/////////////////////////////////////////////////////////////////
+
+	void Release(const Mark &mark) {
+		assert(mark.chunk <= current);
+		current = mark.chunk;
+		used = mark.used;
+		if (current < 0) {
+			size_t total = 0;
+			for (int k = 0; k < (int) sizes.size(); k++)
+				total += sizes[k];
+			if (total > ARENA_RETAIN_BYTES)
+				FreeChunks(-1);
+		}
+	}
+
+	/////////////////////////////////////////////////////////////////
+	// ScratchArena::GetThreadArena()
+	//
+	// Returns the arena of the calling thread.
+	/////////////////////////////////////////////////////////////////
+
+	static ScratchArena &GetThreadArena() {
+		static ScratchArena *arena = NULL;
+#ifdef _OPENMP
+#pragma omp threadprivate(arena)
+#endif
+		if (!arena)
+			arena = new ScratchArena();
+		return *arena;
+	}
+};
+
+/////////////////////////////////////////////////////////////////
+// ScratchScope
+//
+// Releases, when it goes out of scope, every block allocated from
+// an arena since it was created.
+/////////////////////////////////////////////////////////////////
+
+class ScratchScope {
+
+	ScratchArena &arena;
+	ScratchArena::Mark mark;
+
+	ScratchScope(const ScratchScope &);
+	ScratchScope &operator=(const ScratchScope &);
+
+public:
+
+	ScratchScope(ScratchArena &arena) :
+			arena(arena), mark(arena.GetMark()) {
+	}
+
+	~ScratchScope() {
+		arena.Release(mark);
+	}
+};
+
+#endif
@@ -15,17 +15,39 @@
 #include "SafeVector.h"
 #include "FileBuffer.h"
 
+/////////////////////////////////////////////////////////////////
+// SequenceResidues
+//
+// The residues of a sequence without gaps, with residues[0] set to
+// '@', shared by all aligned copies of the sequence held as gap
+// runs and never changed.  The copies count the references.
+/////////////////////////////////////////////////////////////////
+
+struct SequenceResidues {
+	SafeVector<char> chars;                         // residues
+	int refs;                                       // number of references
+};
+
 /////////////////////////////////////////////////////////////////
 // Sequence
 //
-// Class for storing sequence information.
+// Class for storing sequence information.  An aligned sequence is
+// either held as its character data, or as gap runs: the shared
+// residues and the lengths of the alternating runs of gaps and
+// residues along the alignment, starting and ending with a run of
+// gaps, possibly empty.  Gaps are inserted, columns removed and
+// mappings computed on the runs; the character data of a sequence
+// held as gap runs is built only when asked for, and must not be
+// changed.
 /////////////////////////////////////////////////////////////////
 
 class Sequence {
 
 	bool isValid; // a boolean indicating whether the sequence data is valid or not
 	string header;       // string containing the comment line of the FASTA file
-	SafeVector<char> *data;      // pointer to character data
+	mutable SafeVector<char> *data; // pointer to character data, or NULL until needed
+	SequenceResidues *residues;     // residues when held as gap runs, or NULL
+	VI gapRuns;                  // lengths of the runs of gaps and residues
 	int length;                  // length of the sequence
 	int sequenceLabel; // integer sequence label, typically to indicate the ordering of sequences
 					   //   in a Multi-FASTA file
@@ -38,10 +60,135 @@ class Sequence {
 	/////////////////////////////////////////////////////////////////
 
 	Sequence() :
-			isValid(false), header(""), data(NULL), length(0), sequenceLabel(0), inputLabel(
+			isValid(false), header(""), data(NULL), residues(NULL), length(0), sequenceLabel(0), inputLabel(
 					0) {
 	}
 
+	/////////////////////////////////////////////////////////////////
+	// Sequence::ShareRuns()
+	//
+	// Returns a new sequence with the same header and labels, held
+	// as the given gap runs of the residues of this sequence.
+	/////////////////////////////////////////////////////////////////
+
+	Sequence *ShareRuns(const VI &runs, int runsLength) const {
+		assert(residues);
+		Sequence *ret = new Sequence();
+		assert(ret);
+
+		ret->isValid = isValid;
+		ret->header = header;
+		ret->residues = residues;
+#ifdef _OPENMP
+#pragma omp atomic
+#endif
+		residues->refs++;
+		ret->gapRuns = runs;
+		ret->length = runsLength;
+		ret->sequenceLabel = sequenceLabel;
+		ret->inputLabel = inputLabel;
+
+		return ret;
+	}
+
+	/////////////////////////////////////////////////////////////////
+	// Sequence::BuildRuns()
+	//
+	// Starts holding the sequence as gap runs, from its character
+	// data, which is kept.
+	/////////////////////////////////////////////////////////////////
+
+	void BuildRuns() {
+		if (residues)
+			return;
+		residues = new SequenceResidues;
+		assert(residues);
+		residues->refs = 1;
+		residues->chars.push_back('@');
+		gapRuns.assign(1, 0);
+		for (int i = 1; i <= length; i++) {
+			const bool isResidue = (*data)[i] != '-';
+			if (isResidue)
+				residues->chars.push_back((*data)[i]);
+			AppendRun(gapRuns, isResidue, 1);
+		}
+		if (gapRuns.size() % 2 == 0)
+			gapRuns.push_back(0);
+	}
+
+	/////////////////////////////////////////////////////////////////
+	// Sequence::ReleaseRuns()
+	//
+	// Stops holding the sequence as gap runs, building its character
+	// data first.
+	/////////////////////////////////////////////////////////////////
+
+	void ReleaseRuns() {
+		if (!residues)
+			return;
+		BuildData();
+		DropResidues();
+	}
+
+	/////////////////////////////////////////////////////////////////
+	// Sequence::DropResidues()
+	//
+	// Releases the shared residues of a sequence held as gap runs.
+	/////////////////////////////////////////////////////////////////
+
+	void DropResidues() {
+		int refs;
+#ifdef _OPENMP
+#pragma omp atomic capture
+#endif
+		refs = --residues->refs;
+		if (refs == 0)
+			delete residues;
+		residues = NULL;
+		gapRuns.clear();
+	}
+
+	/////////////////////////////////////////////////////////////////
+	// Sequence::BuildData()
+	//
+	// Builds the character data of a sequence held as gap runs.
+	/////////////////////////////////////////////////////////////////
+
+	void BuildData() const {
+		if (data)
+			return;
+		assert(residues);
+		data = new SafeVector<char>;
+		assert(data);
+		data->reserve(length + 1);
+		data->push_back('@');
+		SafeVector<char>::const_iterator residue = residues->chars.begin() + 1;
+		for (int t = 0; t < (int) gapRuns.size(); t++) {
+			if (t % 2 == 0)
+				data->insert(data->end(), gapRuns[t], '-');
+			else {
+				data->insert(data->end(), residue, residue + gapRuns[t]);
+				residue += gapRuns[t];
+			}
+		}
+	}
+
+	/////////////////////////////////////////////////////////////////
+	// Sequence::AppendRun()
+	//
+	// Appends len gaps or residues to a list of gap runs that ends
+	// with a run of gaps when its size is odd.
+	/////////////////////////////////////////////////////////////////
+
+	static void AppendRun(VI &runs, bool isResidue, int len) {
+		if (len == 0)
+			return;
+		if ((runs.size() % 2 == 0) == isResidue)
+			runs.back() += len;
+		else
+			runs.push_back(len);
+	}
+
 public:
 
 	/////////////////////////////////////////////////////////////////
@@ -51,8 +198,8 @@ public:
 	/////////////////////////////////////////////////////////////////
 
 	Sequence(FileBuffer &infile, bool stripGaps = false) :
-			isValid(false), header("~"), data(NULL), length(0), sequenceLabel(
-					0), inputLabel(0) {
+			isValid(false), header("~"), data(NULL), residues(NULL), length(
+					0), sequenceLabel(0), inputLabel(0) {
 
 		// read until the first non-blank line
 		while (!infile.eof()) {
@@ -133,8 +280,8 @@ public:
 
 	Sequence(SafeVector<char> *data, string header, int length,
 			int sequenceLabel, int inputLabel) :
-			isValid(data != NULL), header(header), data(data), length(length), sequenceLabel(
-					sequenceLabel), inputLabel(inputLabel) {
+			isValid(data != NULL), header(header), data(data), residues(NULL), length(
+					length), sequenceLabel(sequenceLabel), inputLabel(inputLabel) {
 		assert(data);
 		assert((*data)[0] == '@');
 	}
@@ -146,6 +293,8 @@ public:
 	/////////////////////////////////////////////////////////////////
 
 	~Sequence() {
+		if (residues)
+			DropResidues();
 		if (data) {
 			assert(isValid);
 			delete data;
@@ -184,7 +333,7 @@ public:
 
 	SafeVector<char>::iterator GetDataPtr() {
 		assert(isValid);
-		assert(data);
+		BuildData();
 		return data->begin();
 	}
 
@@ -197,7 +346,7 @@ public:
 
 	char GetPosition(int i) const {
 		assert(isValid);
-		assert(data);
+		BuildData();
 		assert(i >= 1 && i <= length);
 		return (*data)[i];
 	}
@@ -265,7 +414,7 @@ public:
 
 	int GetLength() const {
 		assert(isValid);
-		assert(data);
+		assert(data || residues);
 		return length;
 	}
 
@@ -281,7 +430,7 @@ public:
 	void WriteMFA(ostream &outfile, int numColumns,
 			bool useIndex = false) const {
 		assert(isValid);
-		assert(data);
+		BuildData();
 		assert(!outfile.fail());
 
 		// print out heading
@@ -304,10 +453,14 @@ public:
 	/////////////////////////////////////////////////////////////////
 	// Sequence::Clone()
 	//
-	// Returns a new deep copy of the seqeuence.
+	// Returns a new deep copy of the seqeuence.  A sequence held as
+	// gap runs shares its residues with the copy.
 	/////////////////////////////////////////////////////////////////
 
 	Sequence *Clone() const {
+		if (residues)
+			return ShareRuns(gapRuns, length);
+
 		Sequence *ret = new Sequence();
 		assert(ret);
 
@@ -337,6 +490,7 @@ public:
 		assert(start >= 1 && start <= length);
 		assert(end >= 1 && end <= length);
 		assert(start <= end);
+		BuildData();
 
 		ret->isValid = isValid;
 		ret->header = header;
@@ -367,29 +521,123 @@ public:
 	/////////////////////////////////////////////////////////////////
 
 	Sequence *AddGaps(SafeVector<char> *alignment, char id) {
-		Sequence *ret = new Sequence();
-		assert(ret);
+		return AddGaps(GetGapRuns(*alignment, id));
+	}
 
-		ret->isValid = isValid;
-		ret->header = header;
-		ret->data = new SafeVector<char>;
-		assert(ret->data);
-		ret->length = (int) alignment->size();
-		ret->sequenceLabel = sequenceLabel;
-		ret->inputLabel = inputLabel;
-		ret->data->push_back('@');
+	/////////////////////////////////////////////////////////////////
+	// Sequence::GetGapRuns()
+	//
+	// Returns the skeleton of an alignment for the sequences of one
+	// side as gap runs: the runs of columns where they get a gap
+	// alternate with the runs of columns that hold their current
+	// columns, starting and ending with gaps.  For instance,
+	//    alignment = "XXXBBYYYBBYYXX"
+	//    id = 'X'
+	// gives {0, 5, 3, 2, 2, 2, 0}.
+	/////////////////////////////////////////////////////////////////
+
+	static VI GetGapRuns(const SafeVector<char> &alignment, char id) {
+		VI runs(1, 0);
+		for (int i = 0; i < (int) alignment.size(); i++)
+			AppendRun(runs, alignment[i] == 'B' || alignment[i] == id, 1);
+		if (runs.size() % 2 == 0)
+			runs.push_back(0);
+		return runs;
+	}
+
+	/////////////////////////////////////////////////////////////////
+	// Sequence::AddGaps()
+	//
+	// Same as above for a skeleton given by GetGapRuns().  The
+	// result is held as gap runs, and built in time proportional to
+	// the number of runs.
+	/////////////////////////////////////////////////////////////////
+
+	Sequence *AddGaps(const VI &alignmentRuns) {
+		BuildRuns();
+
+		VI runs(1, 0);
+		int newLength = 0;
+		int t = 0, left = gapRuns[0];
+		for (int a = 0; a < (int) alignmentRuns.size(); a++) {
+			newLength += alignmentRuns[a];
+			if (a % 2 == 0) {
+				AppendRun(runs, false, alignmentRuns[a]);
+				continue;
+			}
 
-		SafeVector<char>::iterator dataIter = data->begin() + 1;
-		for (SafeVector<char>::iterator iter = alignment->begin();
-				iter != alignment->end(); ++iter) {
-			if (*iter == 'B' || *iter == id) {
-				ret->data->push_back(*dataIter);
-				++dataIter;
-			} else
-				ret->data->push_back('-');
+			// the next columns of this sequence
+			for (int count = alignmentRuns[a]; count > 0;) {
+				while (left == 0)
+					left = gapRuns[++t];
+				const int len = min(left, count);
+				AppendRun(runs, t % 2 == 1, len);
+				left -= len;
+				count -= len;
+			}
 		}
+		if (runs.size() % 2 == 0)
+			runs.push_back(0);
 
-		return ret;
+		return ShareRuns(runs, newLength);
+	}
+
+	/////////////////////////////////////////////////////////////////
+	// Sequence::AddResidueColumns()
+	//
+	// Adds 1 to coverage[i] and subtracts 1 from coverage[j+1] for
+	// every run i..j of columns holding residues, so that the prefix
+	// sums of coverage count the residues in each column.
+	/////////////////////////////////////////////////////////////////
+
+	void AddResidueColumns(VI &coverage) const {
+		assert((int) coverage.size() >= length + 2);
+		if (residues) {
+			for (int t = 0, col = 1; t < (int) gapRuns.size(); t++) {
+				if (t % 2 == 1) {
+					coverage[col]++;
+					coverage[col + gapRuns[t]]--;
+				}
+				col += gapRuns[t];
+			}
+			return;
+		}
+		for (int i = 1; i <= length; i++)
+			if ((*data)[i] != '-') {
+				coverage[i]++;
+				coverage[i + 1]--;
+			}
+	}
+
+	/////////////////////////////////////////////////////////////////
+	// Sequence::RemoveColumns()
+	//
+	// Returns a new sequence without the columns that are not kept,
+	// which must hold gaps.  columns[i] is the number of columns
+	// kept up to column i, so column i is kept if columns[i] differs
+	// from columns[i-1].
+	/////////////////////////////////////////////////////////////////
+
+	Sequence *RemoveColumns(const VI &columns) const {
+		const int newLength = columns[length];
+		if (residues) {
+			VI runs(gapRuns);
+			for (int t = 0, col = 0; t < (int) gapRuns.size(); t++) {
+				if (t % 2 == 0)
+					runs[t] = columns[col + gapRuns[t]] - columns[col];
+				col += gapRuns[t];
+			}
+			return ShareRuns(runs, newLength);
+		}
+
+		SafeVector<char> *newData = new SafeVector<char>;
+		assert(newData);
+		newData->push_back('@');
+		for (int i = 1; i <= length; i++)
+			if (columns[i] != columns[i - 1])
+				newData->push_back((*data)[i]);
+		return new Sequence(newData, header, newLength, sequenceLabel,
+				inputLabel);
 	}
 
 	/////////////////////////////////////////////////////////////////
@@ -399,6 +647,8 @@ public:
 	/////////////////////////////////////////////////////////////////
 
 	string GetString() {
+		if (residues)
+			return string(residues->chars.begin() + 1, residues->chars.end());
 		string s = "";
 		for (int i = 1; i <= length; i++) {
 			if ((*data)[i] != '-')
@@ -417,11 +667,31 @@ public:
 
 	SafeVector<int> *GetMapping() const {
 		SafeVector<int> *ret = new SafeVector<int>(1, 0);
+		AppendMapping(*ret);
+		return ret;
+	}
+
+	/////////////////////////////////////////////////////////////////
+	// Sequence::AppendMapping()
+	//
+	// Appends the indices of every character in the sequence to
+	// columns, as GetMapping() returns them after its entry 0.
+	/////////////////////////////////////////////////////////////////
+
+	void AppendMapping(VI &columns) const {
+		if (residues) {
+			for (int t = 0, col = 0; t < (int) gapRuns.size(); t++) {
+				if (t % 2 == 1)
+					for (int i = 1; i <= gapRuns[t]; i++)
+						columns.push_back(col + i);
+				col += gapRuns[t];
+			}
+			return;
+		}
 		for (int i = 1; i <= length; i++) {
 			if ((*data)[i] != '-')
-				ret->push_back(i);
+				columns.push_back(i);
 		}
-		return ret;
 	}
 
 	/////////////////////////////////////////////////////////////////
@@ -432,6 +702,7 @@ public:
 	/////////////////////////////////////////////////////////////////
 
 	void Highlight(const SafeVector<float> &scores, const float cutoff) {
+		ReleaseRuns();
 		for (int i = 1; i <= length; i++) {
 			if (scores[i - 1] >= cutoff)
 				(*data)[i] = toupper((*data)[i]);
@@ -8,6 +8,8 @@
 #define SPARSEMATRIX_H
 
 #include <iostream>
+#include <cstring>
+#include <algorithm>
 
 using namespace std;
 
@@ -15,34 +17,287 @@ const float POSTERIOR_CUTOFF = 0.01;         // minimum posterior probability
 // value that is maintained in the
 // sparse matrix representation
 
-typedef pair<int, float> PIF;                 // Sparse matrix entry type
-//   first --> column
-//   second --> value
+const int MAX_COLUMN_STEP = 255;      // largest column delta of a stored cell
+
+/////////////////////////////////////////////////////////////////
+// PosteriorCodec
+//
+// Converts posterior values to and from their stored form, which
+// is either a 32-bit float or an 8- or 16-bit code quantizing the
+// range [0,1] uniformly.  Zero is always coded exactly.
+/////////////////////////////////////////////////////////////////
+
+class PosteriorCodec {
+
+	int bits;                                       // bits per stored value
+	float maxCode;                                  // code of probability 1
+	float step;                                     // probability of code 1
+
+public:
+
+	PosteriorCodec(int bits = 32) :
+			bits(bits), maxCode(bits < 32 ? (float) ((1 << bits) - 1) : 1), step(
+					1 / maxCode) {
+		assert(bits == 8 || bits == 16 || bits == 32);
+	}
+
+	int GetBits() const {
+		return bits;
+	}
+
+	/////////////////////////////////////////////////////////////////
+	// PosteriorCodec::GetBytes()
+	//
+	// Returns the number of bytes taken by a stored value.
+	/////////////////////////////////////////////////////////////////
+
+	int GetBytes() const {
+		return bits / 8;
+	}
+
+	/////////////////////////////////////////////////////////////////
+	// PosteriorCodec::IsQuantized()
+	//
+	// Returns whether values are stored as integer codes.
+	/////////////////////////////////////////////////////////////////
+
+	bool IsQuantized() const {
+		return bits < 32;
+	}
+
+	/////////////////////////////////////////////////////////////////
+	// PosteriorCodec::Encode()
+	//
+	// Stores n values, rounding each to the nearest code.
+	/////////////////////////////////////////////////////////////////
+
+	void Encode(const float *values, int n, unsigned char *stored) const {
+		if (bits == 32)
+			memcpy(stored, values, n * sizeof(float));
+		else if (bits == 16) {
+			unsigned short *codes = (unsigned short *) stored;
+			for (int i = 0; i < n; i++)
+				codes[i] = (unsigned short) (values[i] * maxCode + 0.5f);
+		} else {
+			for (int i = 0; i < n; i++)
+				stored[i] = (unsigned char) (values[i] * maxCode + 0.5f);
+		}
+	}
+
+	/////////////////////////////////////////////////////////////////
+	// PosteriorCodec::Decode()
+	//
+	// Recovers n stored values.
+	/////////////////////////////////////////////////////////////////
+
+	void Decode(const unsigned char *stored, int n, float *values) const {
+		if (bits == 32)
+			memcpy(values, stored, n * sizeof(float));
+		else if (bits == 16) {
+			const unsigned short *codes = (const unsigned short *) stored;
+			for (int i = 0; i < n; i++)
+				values[i] = codes[i] * step;
+		} else {
+			for (int i = 0; i < n; i++)
+				values[i] = stored[i] * step;
+		}
+	}
+};
+
+/////////////////////////////////////////////////////////////////
+// SparsityCap
+//
+// Limits on the cells of a posterior matrix that are kept in the
+// sparse representation, on top of POSTERIOR_CUTOFF.  Each row
+// keeps at most rowCells cells, and only its most probable cells
+// up to the first that brings them to a rowMass fraction of the
+// row's mass; the matrix then keeps at most pairCells cells.  The
+// most probable cells are kept in each case, ties going to the
+// lower index.
+/////////////////////////////////////////////////////////////////
+
+class SparsityCap {
+
+	int rowCells;                  // most cells per row, 0 for no limit
+	float rowMass;                 // fraction of the mass of a row kept
+	int pairCells;              // most cells per matrix, 0 for no limit
+
+	/////////////////////////////////////////////////////////////////
+	// SparsityCap::MoreProbable()
+	//
+	// Orders cells, given as (value, index), by decreasing value and
+	// then increasing index.
+	/////////////////////////////////////////////////////////////////
+
+	static bool MoreProbable(const pair<float, int> &a,
+			const pair<float, int> &b) {
+		return a.first > b.first || (a.first == b.first && a.second < b.second);
+	}
+
+public:
+
+	SparsityCap(int rowCells = 0, float rowMass = 1, int pairCells = 0) :
+			rowCells(rowCells), rowMass(rowMass), pairCells(pairCells) {
+	}
+
+	/////////////////////////////////////////////////////////////////
+	// SparsityCap::IsActive()
+	//
+	// Returns whether the cap can drop any cell.
+	/////////////////////////////////////////////////////////////////
+
+	bool IsActive() const {
+		return rowCells > 0 || rowMass < 1 || pairCells > 0;
+	}
+
+	/////////////////////////////////////////////////////////////////
+	// SparsityCap::Apply()
+	//
+	// Zeroes the cells of a (seq1Length+1) x (seq2Length+1)
+	// posterior matrix that are above the threshold but dropped by
+	// the cap.  Adds the mass of the cells above the threshold to
+	// totalMass and the mass of the dropped cells to droppedMass.
+	/////////////////////////////////////////////////////////////////
+
+	void Apply(int seq1Length, int seq2Length, VF &posterior,
+			double &totalMass, double &droppedMass) const {
+		SafeVector<pair<float, int> > cells, kept;
+		for (int i = 1; i <= seq1Length; i++) {
+			const int rowBase = i * (seq2Length + 1);
+			cells.clear();
+			float rowTotal = 0;
+			for (int j = 1; j <= seq2Length; j++) {
+				float value = posterior[rowBase + j];
+				if (value >= POSTERIOR_CUTOFF) {
+					cells.push_back(make_pair(value, rowBase + j));
+					rowTotal += value;
+				}
+			}
+			totalMass += rowTotal;
+			sort(cells.begin(), cells.end(), MoreProbable);
+
+			// keep the most probable cells within both row limits
+			int numKept = 0;
+			float rowKept = 0;
+			while (numKept < (int) cells.size()
+					&& (rowCells == 0 || numKept < rowCells)
+					&& (rowMass >= 1 || numKept == 0
+							|| rowKept < rowMass * rowTotal)) {
+				rowKept += cells[numKept].first;
+				kept.push_back(cells[numKept++]);
+			}
+			for (int c = numKept; c < (int) cells.size(); c++) {
+				droppedMass += cells[c].first;
+				posterior[cells[c].second] = 0;
+			}
+		}
+
+		// keep the most probable cells of the whole matrix
+		if (pairCells > 0 && (int) kept.size() > pairCells) {
+			nth_element(kept.begin(), kept.begin() + pairCells, kept.end(),
+					MoreProbable);
+			for (int c = pairCells; c < (int) kept.size(); c++) {
+				droppedMass += kept[c].first;
+				posterior[kept[c].second] = 0;
+			}
+		}
+	}
+};
 
 /////////////////////////////////////////////////////////////////
 // SparseMatrix
 //
-// Class for sparse matrix computations
+// Class for sparse matrix computations.  Each row is stored as the
+// list of its cells in column order, where the column of a cell is
+// delta-coded as one byte holding the distance from the previous
+// cell of the row (or from column 0 for the first cell), and the
+// packed float values of those cells.  Distances longer than
+// MAX_COLUMN_STEP are bridged by cells of value zero.  A value of
+// zero stands for a cell that is not part of the matrix; it also
+// lets the column layout of a matrix be reused when its values are
+// refilled.
 /////////////////////////////////////////////////////////////////
 
 class SparseMatrix {
 
 	int seq1Length, seq2Length;                     // dimensions of matrix
-	VI rowSize;                              // rowSize[i] = # of cells in row i
-	SafeVector<PIF> data;                           // data values
-	SafeVector<SafeVector<PIF>::iterator> rowPtrs; // pointers to the beginning of each row
+	int *cellStart;          // cellStart[i] = index of the first cell of row i
+	unsigned char *columns;                         // column deltas
+	float *values;                                  // packed data values
+
+	// backing storage when the matrix owns its memory
+	VI ownCellStart;
+	SafeVector<unsigned char> ownColumns;
+	VF ownValues;
 
 	/////////////////////////////////////////////////////////////////
-	// SparseMatrix::SparseMatrix()
+	// SparseMatrix::Rebase()
 	//
-	// Private constructor.
+	// Points the row table, column deltas and values at the owned
+	// storage, if any.  The column layout and the values are owned
+	// separately, so a matrix may own its values while its layout is
+	// bound to external storage.
 	/////////////////////////////////////////////////////////////////
 
-	SparseMatrix() {
+	void Rebase() {
+		if (!ownCellStart.empty()) {
+			cellStart = &ownCellStart[0];
+			columns = ownColumns.empty() ? NULL : &ownColumns[0];
+			values = NULL;
+		}
+		if (!ownValues.empty())
+			values = &ownValues[0];
+	}
+
+	/////////////////////////////////////////////////////////////////
+	// SparseMatrix::Fill()
+	//
+	// Writes the cells of a posterior matrix that are above the
+	// threshold into the given row table, column buffer and value
+	// buffer.  The row table must hold seq1Length+2 entries and the
+	// buffers must have room for CountCells() entries.
+	/////////////////////////////////////////////////////////////////
+
+	static void Fill(int seq1Length, int seq2Length, const VF &posterior,
+			int *cellStart, unsigned char *columns, float *values) {
+		VF::const_iterator postPtr = posterior.begin() + seq2Length + 1; // note that we're skipping the first row here
+		unsigned char *columnPtr = columns;
+		float *valuePtr = values;
+		cellStart[0] = 0;
+		for (int i = 1; i <= seq1Length; i++) {
+			postPtr++;              // and skipping the first column of each row
+			cellStart[i] = valuePtr - values;
+			int last = 0;                       // column of the last cell of the row
+			for (int j = 1; j <= seq2Length; j++) {
+				if (*postPtr >= POSTERIOR_CUTOFF) {
+					for (; j - last > MAX_COLUMN_STEP; last += MAX_COLUMN_STEP) {
+						*columnPtr++ = MAX_COLUMN_STEP;
+						*valuePtr++ = 0;
+					}
+					*columnPtr++ = j - last;
+					*valuePtr++ = *postPtr;
+					last = j;
+				}
+				postPtr++;
+			}
+		}
+		cellStart[seq1Length + 1] = valuePtr - values;
 	}
 
 public:
 
+	/////////////////////////////////////////////////////////////////
+	// SparseMatrix::SparseMatrix()
+	//
+	// Constructor.  Builds an empty matrix which can later be bound
+	// to external storage or filled by ComputeTranspose().
+	/////////////////////////////////////////////////////////////////
+
+	SparseMatrix() :
+			seq1Length(0), seq2Length(0), cellStart(NULL), columns(NULL), values(
+					NULL) {
+	}
+
 	/////////////////////////////////////////////////////////////////
 	// SparseMatrix::SparseMatrix()
 	//
@@ -55,57 +310,166 @@ public:
 	SparseMatrix(int seq1Length, int seq2Length, const VF &posterior) :
 			seq1Length(seq1Length), seq2Length(seq2Length) {
 
-		int numCells = 0;
-
 		assert(seq1Length > 0);
 		assert(seq2Length > 0);
 
-		// calculate memory required; count the number of cells in the
-		// posterior matrix above the threshold
+		// allocate memory
+		int numCells = CountCells(seq1Length, seq2Length, posterior);
+		ownColumns.resize(numCells);
+		ownValues.resize(numCells);
+		ownCellStart.resize(seq1Length + 2);
+		Rebase();
+
+		// build sparse matrix
+		Fill(seq1Length, seq2Length, posterior, cellStart, columns, values);
+	}
+
+	/////////////////////////////////////////////////////////////////
+	// SparseMatrix::SparseMatrix()
+	//
+	// Copy constructor.  Storage bound to the matrix is shared with
+	// the copy, while storage owned by the matrix is copied deeply.
+	/////////////////////////////////////////////////////////////////
+
+	SparseMatrix(const SparseMatrix &other) :
+			seq1Length(other.seq1Length), seq2Length(other.seq2Length), cellStart(
+					other.cellStart), columns(other.columns), values(
+					other.values), ownCellStart(other.ownCellStart), ownColumns(
+					other.ownColumns), ownValues(other.ownValues) {
+		Rebase();
+	}
+
+	SparseMatrix &operator=(const SparseMatrix &other) {
+		if (this != &other) {
+			seq1Length = other.seq1Length;
+			seq2Length = other.seq2Length;
+			cellStart = other.cellStart;
+			columns = other.columns;
+			values = other.values;
+			ownCellStart = other.ownCellStart;
+			ownColumns = other.ownColumns;
+			ownValues = other.ownValues;
+			Rebase();
+		}
+		return *this;
+	}
+
+	/////////////////////////////////////////////////////////////////
+	// SparseMatrix::CountCells()
+	//
+	// Returns the number of cells, including those bridging long
+	// column distances, needed to keep the cells of a posterior
+	// matrix that are above the threshold.
+	/////////////////////////////////////////////////////////////////
+
+	static int CountCells(int seq1Length, int seq2Length, const VF &posterior) {
+		int numCells = 0;
+
 		VF::const_iterator postPtr = posterior.begin();
 		for (int i = 0; i <= seq1Length; i++) {
+			int last = 0;
 			for (int j = 0; j <= seq2Length; j++) {
 				if (*(postPtr++) >= POSTERIOR_CUTOFF) {
 					assert(i != 0 && j != 0);
-					numCells++;
+					numCells += 1 + (j - last - 1) / MAX_COLUMN_STEP;
+					last = j;
 				}
 			}
 		}
+		return numCells;
+	}
 
-		// allocate memory
-		data.resize(numCells);
-		rowSize.resize(seq1Length + 1);
-		rowSize[0] = -1;
-		rowPtrs.resize(seq1Length + 1);
-		rowPtrs[0] = data.end();
+	/////////////////////////////////////////////////////////////////
+	// SparseMatrix::Assign()
+	//
+	// Builds the sparse matrix from a posterior matrix into external
+	// storage.  The row table must hold seq1Length+2 entries and the
+	// buffers must have room for CountCells() entries; the matrix
+	// does not take ownership of any of them.
+	/////////////////////////////////////////////////////////////////
 
-		// build sparse matrix
-		postPtr = posterior.begin() + seq2Length + 1; // note that we're skipping the first row here
-		SafeVector<PIF>::iterator dataPtr = data.begin();
+	void Assign(int seq1Length, int seq2Length, const VF &posterior,
+			int *cellStart, unsigned char *columns, float *values) {
+		assert(seq1Length > 0);
+		assert(seq2Length > 0);
+
+		Bind(seq1Length, seq2Length, cellStart, columns, values);
+		Fill(seq1Length, seq2Length, posterior, cellStart, columns, values);
+	}
+
+	/////////////////////////////////////////////////////////////////
+	// SparseMatrix::Bind()
+	//
+	// Points the matrix at an already built column layout and value
+	// buffer held in external storage.
+	/////////////////////////////////////////////////////////////////
+
+	void Bind(int seq1Length, int seq2Length, int *cellStart,
+			unsigned char *columns, float *values) {
+		VI().swap(ownCellStart);
+		SafeVector<unsigned char>().swap(ownColumns);
+		VF().swap(ownValues);
+		this->seq1Length = seq1Length;
+		this->seq2Length = seq2Length;
+		this->cellStart = cellStart;
+		this->columns = columns;
+		this->values = values;
+	}
+
+	/////////////////////////////////////////////////////////////////
+	// SparseMatrix::AllocateValues()
+	//
+	// Gives the matrix its own value buffer, keeping the column
+	// layout, and returns it for the caller to fill.
+	/////////////////////////////////////////////////////////////////
+
+	float *AllocateValues() {
+		ownValues.resize(GetNumValues());
+		values = ownValues.empty() ? NULL : &ownValues[0];
+		return values;
+	}
+
+	/////////////////////////////////////////////////////////////////
+	// SparseMatrix::Refill()
+	//
+	// Overwrites the values of the matrix with those of a posterior
+	// matrix, keeping the column layout.  Cells of the layout that
+	// fall below the threshold are set to zero; cells outside the
+	// layout are ignored.
+	/////////////////////////////////////////////////////////////////
+
+	void Refill(const VF &posterior) {
 		for (int i = 1; i <= seq1Length; i++) {
-			postPtr++;              // and skipping the first column of each row
-			rowPtrs[i] = dataPtr;
-			for (int j = 1; j <= seq2Length; j++) {
-				if (*postPtr >= POSTERIOR_CUTOFF) {
-					dataPtr->first = j;
-					dataPtr->second = *postPtr;
-					dataPtr++;
-				}
-				postPtr++;
+			VF::const_iterator postPtr = posterior.begin() + i * (seq2Length + 1);
+			int j = 0;
+			for (int c = cellStart[i]; c < cellStart[i + 1]; c++) {
+				j += columns[c];
+				float value = postPtr[j];
+				values[c] = value >= POSTERIOR_CUTOFF ? value : 0;
 			}
-			rowSize[i] = dataPtr - rowPtrs[i];
 		}
 	}
 
 	/////////////////////////////////////////////////////////////////
-	// SparseMatrix::GetRowPtr()
+	// SparseMatrix::GetColumnPtr()
 	//
-	// Returns the pointer to a particular row in the sparse matrix.
+	// Returns the pointer to the column deltas of a row.
 	/////////////////////////////////////////////////////////////////
 
-	SafeVector<PIF>::iterator GetRowPtr(int row) const {
+	const unsigned char *GetColumnPtr(int row) const {
 		assert(row >= 1 && row <= seq1Length);
-		return rowPtrs[row];
+		return columns + cellStart[row];
+	}
+
+	/////////////////////////////////////////////////////////////////
+	// SparseMatrix::GetValuePtr()
+	//
+	// Returns the pointer to the packed values of a row.
+	/////////////////////////////////////////////////////////////////
+
+	const float *GetValuePtr(int row) const {
+		assert(row >= 1 && row <= seq1Length);
+		return values + cellStart[row];
 	}
 
 	/////////////////////////////////////////////////////////////////
@@ -114,12 +478,14 @@ public:
 	// Returns value at a particular row, column.
 	/////////////////////////////////////////////////////////////////
 
-	float GetValue(int row, int col) {
+	float GetValue(int row, int col) const {
 		assert(row >= 1 && row <= seq1Length);
 		assert(col >= 1 && col <= seq2Length);
-		for (int i = 0; i < rowSize[row]; i++) {
-			if (rowPtrs[row][i].first == col)
-				return rowPtrs[row][i].second;
+		int column = 0;
+		for (int c = cellStart[row]; c < cellStart[row + 1]; c++) {
+			column += columns[c];
+			if (column >= col)
+				return column == col ? values[c] : 0;
 		}
 		return 0;
 	}
@@ -127,12 +493,12 @@ public:
 	/////////////////////////////////////////////////////////////////
 	// SparseMatrix::GetRowSize()
 	//
-	// Returns the number of entries in a particular row.
+	// Returns the number of cells stored for a particular row.
 	/////////////////////////////////////////////////////////////////
 
 	int GetRowSize(int row) const {
 		assert(row >= 1 && row <= seq1Length);
-		return rowSize[row];
+		return cellStart[row + 1] - cellStart[row];
 	}
 
 	/////////////////////////////////////////////////////////////////
@@ -156,13 +522,28 @@ public:
 	}
 
 	/////////////////////////////////////////////////////////////////
-	// SparseMatrix::GetRowPtr
+	// SparseMatrix::GetNumValues()
+	//
+	// Returns the number of cells stored by the column layout,
+	// including zeros.
+	/////////////////////////////////////////////////////////////////
+
+	int GetNumValues() const {
+		return cellStart ? cellStart[seq1Length + 1] : 0;
+	}
+
+	/////////////////////////////////////////////////////////////////
+	// SparseMatrix::GetNumCells()
 	//
-	// Returns the pointer to a particular row in the sparse matrix.
+	// Returns the number of nonzero cells in the sparse matrix.
 	/////////////////////////////////////////////////////////////////
 
 	int GetNumCells() const {
-		return data.size();
+		int numCells = 0;
+		for (int i = 0; i < GetNumValues(); i++)
+			if (values[i] != 0)
+				numCells++;
+		return numCells;
 	}
 
 	/////////////////////////////////////////////////////////////////
@@ -175,9 +556,11 @@ public:
 		outfile << "Sparse Matrix:" << endl;
 		for (int i = 1; i <= seq1Length; i++) {
 			outfile << "  " << i << ":";
-			for (int j = 0; j < rowSize[i]; j++) {
-				outfile << " (" << rowPtrs[i][j].first << ","
-						<< rowPtrs[i][j].second << ")";
+			int j = 0;
+			for (int c = cellStart[i]; c < cellStart[i + 1]; c++) {
+				j += columns[c];
+				if (values[c] != 0)
+					outfile << " (" << j << "," << values[c] << ")";
 			}
 			outfile << endl;
 		}
@@ -191,48 +574,69 @@ public:
 	/////////////////////////////////////////////////////////////////
 
 	SparseMatrix *ComputeTranspose() const {
-
-		// create a new sparse matrix
 		SparseMatrix *ret = new SparseMatrix();
-		int numCells = data.size();
+		ComputeTranspose(*ret);
+		return ret;
+	}
 
-		ret->seq1Length = seq2Length;
-		ret->seq2Length = seq1Length;
+	/////////////////////////////////////////////////////////////////
+	// SparseMatrix::ComputeTranspose()
+	//
+	// Stores the transpose of the current matrix in ret, which must
+	// own its memory.  The storage of ret is reused, so a single
+	// scratch matrix can serve any number of transposes.  Zero
+	// cells are dropped.
+	/////////////////////////////////////////////////////////////////
 
-		// allocate memory
-		ret->data.resize(numCells);
-		ret->rowSize.resize(seq2Length + 1);
-		ret->rowSize[0] = -1;
-		ret->rowPtrs.resize(seq2Length + 1);
-		ret->rowPtrs[0] = ret->data.end();
-
-		// compute row sizes
-		for (int i = 1; i <= seq2Length; i++)
-			ret->rowSize[i] = 0;
-		for (int i = 0; i < numCells; i++)
-			ret->rowSize[data[i].first]++;
-
-		// compute row ptrs
-		for (int i = 1; i <= seq2Length; i++) {
-			ret->rowPtrs[i] =
-					(i == 1) ?
-							ret->data.begin() :
-							ret->rowPtrs[i - 1] + ret->rowSize[i - 1];
-		}
+	void ComputeTranspose(SparseMatrix &ret) const {
+		ret.seq1Length = seq2Length;
+		ret.seq2Length = seq1Length;
 
-		// now fill in data
-		SafeVector<SafeVector<PIF>::iterator> currPtrs = ret->rowPtrs;
+		ret.ownCellStart.assign(seq2Length + 2, 0);
 
+		// count cells of every column, shifted by one so that the
+		// prefix sums below yield the start of each row
+		VI last(seq2Length + 1, 0);      // last row with a cell in each column
 		for (int i = 1; i <= seq1Length; i++) {
-			SafeVector<PIF>::iterator row = rowPtrs[i];
-			for (int j = 0; j < rowSize[i]; j++) {
-				currPtrs[row[j].first]->first = i;
-				currPtrs[row[j].first]->second = row[j].second;
-				currPtrs[row[j].first]++;
+			int j = 0;
+			for (int c = cellStart[i]; c < cellStart[i + 1]; c++) {
+				j += columns[c];
+				if (values[c] == 0)
+					continue;
+				ret.ownCellStart[j + 1] += 1 + (i - last[j] - 1) / MAX_COLUMN_STEP;
+				last[j] = i;
 			}
 		}
 
-		return ret;
+		// compute row starts
+		for (int j = 2; j <= seq2Length + 1; j++)
+			ret.ownCellStart[j] += ret.ownCellStart[j - 1];
+
+		// allocate memory
+		ret.ownColumns.resize(ret.ownCellStart[seq2Length + 1]);
+		ret.ownValues.resize(ret.ownCellStart[seq2Length + 1]);
+		ret.Rebase();
+
+		// now fill in columns and values
+		VI currCells(ret.ownCellStart);
+		last.assign(seq2Length + 1, 0);
+		for (int i = 1; i <= seq1Length; i++) {
+			int j = 0;
+			for (int c = cellStart[i]; c < cellStart[i + 1]; c++) {
+				j += columns[c];
+				float value = values[c];
+				if (value == 0)
+					continue;
+				int &cell = currCells[j];
+				for (; i - last[j] > MAX_COLUMN_STEP; last[j] += MAX_COLUMN_STEP) {
+					ret.columns[cell] = MAX_COLUMN_STEP;
+					ret.values[cell++] = 0;
+				}
+				ret.columns[cell] = i - last[j];
+				ret.values[cell++] = value;
+				last[j] = i;
+			}
+		}
 	}
 
 	/////////////////////////////////////////////////////////////////
@@ -246,19 +650,30 @@ public:
 		// create a new posterior matrix
 		VF *posteriorPtr = new VF((seq1Length + 1) * (seq2Length + 1));
 		assert(posteriorPtr);
-		VF &posterior = *posteriorPtr;
+		GetPosterior(*posteriorPtr);
+
+		return posteriorPtr;
+	}
+
+	/////////////////////////////////////////////////////////////////
+	// SparseMatrix::GetPosterior()
+	//
+	// Writes the posterior representation of the sparse matrix into
+	// an existing buffer, resizing it as needed.
+	/////////////////////////////////////////////////////////////////
+
+	void GetPosterior(VF &posterior) const {
 
 		// build the posterior matrix
-		for (int i = 0; i < (seq1Length + 1) * (seq2Length + 1); i++)
-			posterior[i] = 0;
+		posterior.assign((seq1Length + 1) * (seq2Length + 1), 0);
 		for (int i = 1; i <= seq1Length; i++) {
 			VF::iterator postPtr = posterior.begin() + i * (seq2Length + 1);
-			for (int j = 0; j < rowSize[i]; j++) {
-				postPtr[rowPtrs[i][j].first] = rowPtrs[i][j].second;
+			int j = 0;
+			for (int c = cellStart[i]; c < cellStart[i + 1]; c++) {
+				j += columns[c];
+				postPtr[j] = values[c];
 			}
 		}
-
-		return posteriorPtr;
 	}
 
 };
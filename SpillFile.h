@@ -0,0 +1,262 @@
+/////////////////////////////////////////////////////////////////
+// SpillFile.h
+//
+// Disk-backed storage for data sets that exceed main memory.
+/////////////////////////////////////////////////////////////////
+
+#ifndef SPILLFILE_H
+#define SPILLFILE_H
+
+#include <iostream>
+#include <string>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "SafeVector.h"
+
+using namespace std;
+
+/////////////////////////////////////////////////////////////////
+// SpillFile
+//
+// Anonymous temporary file that grows by page-aligned regions,
+// each of which is memory-mapped for reading and writing, and by
+// blocks that are written and read back explicitly.  The file is
+// unlinked as soon as it is created, so it disappears when the
+// program exits, however it exits.  Resident pages of a region
+// can be dropped with Evict(); the kernel reads them back from the
+// file on the next access.
+/////////////////////////////////////////////////////////////////
+
+class SpillFile {
+
+	int fd;                                         // file descriptor
+	off_t size;                                     // size of the file
+	size_t pageSize;                                // size of a memory page
+
+	SpillFile(const SpillFile &);
+	SpillFile &operator=(const SpillFile &);
+
+	/////////////////////////////////////////////////////////////////
+	// SpillFile::Fail()
+	//
+	// Reports a failed system call and exits.
+	/////////////////////////////////////////////////////////////////
+
+	static void Fail(const char *what) {
+		cerr << "ERROR: Spill file " << what << " failed: " << strerror(errno)
+				<< endl;
+		exit(1);
+	}
+
+public:
+
+	/////////////////////////////////////////////////////////////////
+	// SpillFile::SpillFile()
+	//
+	// Constructor.  Creates an empty spill file in the given
+	// directory.
+	/////////////////////////////////////////////////////////////////
+
+	SpillFile(const string &directory) :
+			size(0), pageSize(sysconf(_SC_PAGESIZE)) {
+		string name = directory + "/glprobs-spill-XXXXXX";
+		SafeVector<char> path(name.size() + 1);
+		strcpy(&path[0], name.c_str());
+		fd = mkstemp(&path[0]);
+		if (fd < 0)
+			Fail("creation");
+		unlink(&path[0]);
+	}
+
+	~SpillFile() {
+		close(fd);
+	}
+
+	/////////////////////////////////////////////////////////////////
+	// SpillFile::Map()
+	//
+	// Appends a region of the given size to the file and maps it.
+	// Returns the address of the region and its offset in the file.
+	/////////////////////////////////////////////////////////////////
+
+	void *Map(size_t bytes, off_t &offset) {
+		offset = (size + pageSize - 1) / pageSize * pageSize;
+		if (bytes == 0)
+			return NULL;
+		size = offset + (bytes + pageSize - 1) / pageSize * pageSize;
+		if (ftruncate(fd, size) != 0)
+			Fail("resizing");
+		void *data = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+				offset);
+		if (data == MAP_FAILED)
+			Fail("mapping");
+		return data;
+	}
+
+	/////////////////////////////////////////////////////////////////
+	// SpillFile::Unmap()
+	//
+	// Unmaps a region.  Its space in the file is not reclaimed.
+	/////////////////////////////////////////////////////////////////
+
+	static void Unmap(void *data, size_t bytes) {
+		if (data)
+			munmap(data, bytes);
+	}
+
+	/////////////////////////////////////////////////////////////////
+	// SpillFile::Evict()
+	//
+	// Writes back the dirty pages of a mapped region and drops all
+	// of its pages from memory.  The region stays mapped.
+	/////////////////////////////////////////////////////////////////
+
+	void Evict(void *data, size_t bytes, off_t offset) const {
+		if (!data)
+			return;
+		msync(data, bytes, MS_SYNC);
+		madvise(data, bytes, MADV_DONTNEED);
+		posix_fadvise(fd, offset, bytes, POSIX_FADV_DONTNEED);
+	}
+
+	/////////////////////////////////////////////////////////////////
+	// SpillFile::Reserve()
+	//
+	// Appends a block of the given size to the file, outside of any
+	// mapped region, and returns its offset.  May be called
+	// concurrently, but not together with Map().
+	/////////////////////////////////////////////////////////////////
+
+	off_t Reserve(size_t bytes) {
+		off_t offset;
+#ifdef _OPENMP
+#pragma omp critical(SpillFileReserve)
+#endif
+		{
+			offset = size;
+			size += bytes;
+		}
+		return offset;
+	}
+
+	/////////////////////////////////////////////////////////////////
+	// SpillFile::Write()
+	//
+	// Writes data into a block obtained from Reserve().
+	/////////////////////////////////////////////////////////////////
+
+	void Write(const void *data, size_t bytes, off_t offset) {
+		if (bytes && pwrite(fd, data, bytes, offset) != (ssize_t) bytes)
+			Fail("writing");
+	}
+
+	/////////////////////////////////////////////////////////////////
+	// SpillFile::Read()
+	//
+	// Reads back data written by Write().
+	/////////////////////////////////////////////////////////////////
+
+	void Read(void *data, size_t bytes, off_t offset) const {
+		if (bytes && pread(fd, data, bytes, offset) != (ssize_t) bytes)
+			Fail("reading");
+	}
+};
+
+/////////////////////////////////////////////////////////////////
+// SpillArray
+//
+// Fixed-size array that lives on the heap, or in a mapped region
+// of a spill file when one is given.
+/////////////////////////////////////////////////////////////////
+
+template<class TYPE>
+class SpillArray {
+
+	TYPE *data;                                     // elements
+	size_t count;                                   // number of elements
+	SpillFile *file;                        // file holding the elements, if any
+	off_t offset;                                   // offset of data in file
+
+	SpillArray(const SpillArray &);
+	SpillArray &operator=(const SpillArray &);
+
+public:
+
+	SpillArray() :
+			data(NULL), count(0), file(NULL), offset(0) {
+	}
+
+	~SpillArray() {
+		Release();
+	}
+
+	/////////////////////////////////////////////////////////////////
+	// SpillArray::Allocate()
+	//
+	// Gives the array count zeroed elements, held in spillFile if it
+	// is not NULL.  Does nothing if the array already has that many
+	// elements in the same place.
+	/////////////////////////////////////////////////////////////////
+
+	void Allocate(size_t count, SpillFile *spillFile) {
+		if (data && count == this->count && file == spillFile)
+			return;
+		Release();
+		this->count = count;
+		file = spillFile;
+		if (count == 0)
+			return;
+		if (file)
+			data = (TYPE *) file->Map(count * sizeof(TYPE), offset);
+		else
+			data = new TYPE[count]();
+	}
+
+	/////////////////////////////////////////////////////////////////
+	// SpillArray::Release()
+	//
+	// Frees the elements.
+	/////////////////////////////////////////////////////////////////
+
+	void Release() {
+		if (file)
+			SpillFile::Unmap(data, count * sizeof(TYPE));
+		else
+			delete[] data;
+		data = NULL;
+		count = 0;
+	}
+
+	/////////////////////////////////////////////////////////////////
+	// SpillArray::Evict()
+	//
+	// Drops the resident pages of an array held in a spill file.
+	/////////////////////////////////////////////////////////////////
+
+	void Evict() const {
+		if (file)
+			file->Evict(data, count * sizeof(TYPE), offset);
+	}
+
+	TYPE &operator[](size_t index) {
+		return data[index];
+	}
+
+	const TYPE &operator[](size_t index) const {
+		return data[index];
+	}
+
+	size_t size() const {
+		return count;
+	}
+
+	bool empty() const {
+		return count == 0;
+	}
+};
+
+#endif
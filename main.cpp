@@ -13,8 +13,20 @@
  * ************************************************/
 #include "MSA.h"
 
+#ifdef GLPROBS_MPI
+#include <mpi.h>
+#endif
+
 int main(int argc, char* argv[]) {
-	MSA msa(argc, argv);
+#ifdef GLPROBS_MPI
+	MPI_Init(&argc, &argv);
+#endif
+	{
+		MSA msa(argc, argv);
+	}
+#ifdef GLPROBS_MPI
+	MPI_Finalize();
+#endif
 
 	return 0;
 }